@@ -0,0 +1,7 @@
+#include "fusion_bench.h"
+
+// Host build of the fusion bench (make host-bench), fails when any run misses its thresholds
+int main(void)
+{
+    return fusion_bench_run() != 0;
+}
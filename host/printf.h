@@ -0,0 +1,7 @@
+#ifndef PRINTF_H
+#define PRINTF_H
+
+// Host build: the firmware printf (src/printf) maps to the C library one
+#include <stdio.h>
+
+#endif
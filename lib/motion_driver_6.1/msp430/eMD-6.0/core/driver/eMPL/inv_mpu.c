@@ -101,6 +101,28 @@ static inline int reg_int_cb(struct int_param_s *int_param)
 /* UC3 is a 32-bit processor, so abs and labs are equivalent. */
 #define labs        abs
 #define fabs(x)     (((x)>0)?(x):-(x))
+#elif defined EMPL_TARGET_NRF51
+/* twiz-fw (nRF51822): the i2c_wrapper.c HAL, the INT pin is handled by mpu9150.c. */
+#include "i2c_wrapper.h"
+#include "nrf_delay.h"
+#include "high_res_timer.h"
+#define i2c_write   i2c_write_bytes
+#define i2c_read    i2c_read_bytes
+#define delay_ms    nrf_delay_ms
+static inline int get_ms(unsigned long *count)
+{
+    *count = get_time() / 1000;
+    return 0;
+}
+static inline int reg_int_cb(struct int_param_s *int_param)
+{
+    return 0;
+}
+#define log_i(...)     do {} while (0)
+#define log_e(...)     do {} while (0)
+/* fabs is for doubles. fabsf is for floats. */
+#define fabs        fabsf
+#define min(a,b) ((a<b)?a:b)
 #else
 #error  Gyro driver is missing the system layer implementations.
 #endif
@@ -62,6 +62,20 @@
 #define log_i       MPL_LOGI
 #define log_e       MPL_LOGE
 
+#elif defined EMPL_TARGET_NRF51
+/* twiz-fw (nRF51822) */
+#include "nrf_delay.h"
+#include "high_res_timer.h"
+#define delay_ms    nrf_delay_ms
+static inline int get_ms(unsigned long *count)
+{
+    *count = get_time() / 1000;
+    return 0;
+}
+#define log_i(...)     do {} while (0)
+#define log_e(...)     do {} while (0)
+#define __no_operation()
+
 #else
 #error  Gyro driver is missing the system layer implementations.
 #endif
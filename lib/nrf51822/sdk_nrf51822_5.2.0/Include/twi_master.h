@@ -91,6 +91,11 @@ bool twi_master_init(void);
  */
 bool twi_master_transfer(uint8_t address, uint8_t *data, uint8_t data_length, bool issue_stop_condition);
 
+/**
+ * @brief Number of bus clear sequences run since the start, for the bus diagnostics.
+ */
+extern uint32_t twi_master_clear_bus_count;
+
 /**
  *@}
  **/
@@ -0,0 +1,252 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "ak8963.h"
+#include "printf.h"
+#include "i2c_wrapper.h"
+#include "nrf_delay.h"
+#include "app_error.h"
+#include "mpu9150.h"
+#include "high_res_timer.h"
+#include "mag_calibration.h"
+
+// Magnetometer registers
+#define AK8963_ADDRESS   0x0C
+
+#define WHO_AM_I_AK8963  0x00 // should return 0x48
+#define AK8963_ST1       0x02 // data ready bit 0, data overrun bit 1
+#define AK8963_XOUT_L    0x03 // data
+#define AK8963_ST2       0x09 // magnetic sensor overflow bit 3, output bit setting (BITM) bit 4
+#define AK8963_CNTL1     0x0A // output bit setting (BIT) bit 4, mode on bits 3:0
+#define AK8963_CNTL2     0x0B // soft reset bit 0
+#define AK8963_ASTC      0x0C // self test control
+#define AK8963_ASAX      0x10 // fuse ROM x, y, z axis sensitivity adjustment values
+
+// CNTL1 settings
+#define AK8963_POWER_DOWN 0x00
+#define AK8963_SELF_TEST  0x08
+#define AK8963_FUSE_ROM   0x0F
+#define AK8963_CONT_8HZ   0x02
+#define AK8963_CONT_100HZ 0x06
+#define AK8963_16BIT      0x10
+
+#define AK8963_MODE       (AK8963_16BIT | AK8963_CONT_100HZ)
+#define AK8963_PERIOD     10000UL   // us, between two measures
+
+// True if a compass answers at the AK8963 address. The MPU must be in bypass mode.
+bool ak8963_probe(void)
+{
+    uint8_t whoami;
+
+    return i2c_read_bytes(AK8963_ADDRESS, WHO_AM_I_AK8963, 1, &whoami) == 0 && whoami == 0x48;
+}
+
+// Init magnetometer, and start the continuous measures.
+// MUST be called AFTER the MPU init !
+void ak8963_init(void)
+{
+    uint8_t whoami = 0;
+    int err = i2c_read_byte(AK8963_ADDRESS, WHO_AM_I_AK8963, &whoami);
+    printf("AK8963 : I am 0x%x\n\r", whoami);
+
+    if (err || whoami != 0x48) {
+        // WHO_AM_I should be 0x48
+        printf("ERROR : I SHOULD BE 0x48\n\r");
+        APP_ERROR_CHECK_BOOL(false);
+    }
+    printf("AK8963 is online...\n\r");
+
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL2, 0x01);
+    nrf_delay_ms(10);
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_MODE);
+    nrf_delay_ms(10);
+}
+
+// Measures are 16 bit signed, a component at full scale means the field is out of range
+// (typically a magnet or some iron close to the sensor)
+#define AK8963_FULL_SCALE 32760
+
+// Check for saturation and swap the axes. Returns false, leaving val untouched, if saturated.
+static bool ak8963_convert(const int16_t *v, int16_t *val)
+{
+    for (int i = 0; i < 3; i++)
+        if (v[i] >= AK8963_FULL_SCALE || v[i] <= -AK8963_FULL_SCALE)
+            return false;
+
+    // Same axes as the AK8975A in the MPU9150: x <--> y, and z <--> -z
+    val[0] = v[1];
+    val[1] = v[0];
+    val[2] = -v[2];
+    return true;
+}
+
+// Latest measure, shared by the polled and the auxiliary I2C master modes
+static int16_t last_data[3];
+static bool last_valid = false;
+static uint32_t read_at, measured_at;
+
+// Parse the AK8963_AUX_LEN bytes from ST1 to ST2 into the latest measure. Returns true if
+// there was a new measure (ST1 data ready bit set).
+static bool ak8963_parse(const uint8_t *st)
+{
+    int16_t v[3];
+
+    if ((st[0] & 0x01) == 0)
+        return false;
+
+    // WARNING : code valid for little endian only !
+    for (int i = 0; i < 3; i++)
+        v[i] = (int16_t)(st[1 + 2 * i] | (st[2 + 2 * i] << 8));
+
+    // Overflow in ST2
+    last_valid = (st[7] & 0x08) == 0 && ak8963_convert(v, last_data);
+    return true;
+}
+
+// Read ST1 to ST2 until the data ready bit is set. False on a bus error, or if no measure
+// comes.
+static bool ak8963_wait_ready(uint8_t *st)
+{
+    uint32_t start = get_time();
+
+    do {
+        if (i2c_read_bytes(AK8963_ADDRESS, AK8963_ST1, AK8963_AUX_LEN, st) != 0)
+            return false;
+        if (st[0] & 0x01)
+            return true;
+    } while (get_time() - start < 2 * AK8963_PERIOD);
+    return false;
+}
+
+// Wait for the next measure (for the calibration, see ak8963_read_data() for the fusion).
+// Returns false, leaving val untouched, if the sensor reported an overflow, if the measure
+// is saturated, or if there is no measure.
+bool ak8963_read_raw_data(int16_t *val)
+{
+    uint8_t st[AK8963_AUX_LEN];
+
+    if (!ak8963_wait_ready(st))
+        return false;
+    ak8963_parse(st);
+
+    if (!last_valid)
+        return false;
+    val[0] = last_data[0];
+    val[1] = last_data[1];
+    val[2] = last_data[2];
+    return true;
+}
+
+// Result of a non-blocking read, fresh if a new measure was just parsed
+static imu_mag_read_t ak8963_result(bool fresh, float *mx, float *my, float *mz)
+{
+    if (!last_valid)
+        return fresh ? IMU_MAG_INVALID : IMU_MAG_NONE;
+
+    mag_calibration_correct(last_data, mx, my, mz);
+    return fresh ? IMU_MAG_NEW : IMU_MAG_SAME;
+}
+
+// Non-blocking: the compass measures on its own, a burst read (ST1 to ST2, which also
+// releases the data registers) is only done once a new measure can be there.
+imu_mag_read_t ak8963_read_data(float *mx, float *my, float *mz)
+{
+    uint8_t st[AK8963_AUX_LEN];
+    uint32_t now = get_time();
+    bool fresh = false;
+
+    if (now - read_at >= AK8963_PERIOD) {
+        if (i2c_read_bytes(AK8963_ADDRESS, AK8963_ST1, AK8963_AUX_LEN, st) == 0 && ak8963_parse(st)) {
+            read_at = now;
+            measured_at = now;
+            fresh = true;
+        }
+    }
+
+    if (now - measured_at > IMU_MAG_MAX_AGE)
+        return IMU_MAG_NONE;
+    return ak8963_result(fresh, mx, my, mz);
+}
+
+// Auxiliary I2C master mode (MPU9150_AUX_MAG build): the MPU reads ST1 to ST2 (slave 0).
+// The measures are continuous, nothing has to be triggered: the compass is only read at its
+// own rate. Enable it again after a sample rate change.
+void ak8963_aux_enable(bool enable)
+{
+    if (enable) {
+        uint32_t period = mpu9150_sample_period();
+
+        mpu9150_aux_read_setup(0, AK8963_ADDRESS, AK8963_ST1, AK8963_AUX_LEN);
+        mpu9150_aux_rate(0x01, (AK8963_PERIOD + period - 1) / period - 1);
+    }
+    last_valid = false;
+    mpu9150_aux_master_enable(enable);
+}
+
+// Same as ak8963_read_data(), from the AK8963_AUX_LEN bytes (ST1 to ST2) copied by the MPU
+// into its EXT_SENS_DATA registers. The MPU keeps its copy until it reads the compass
+// again, a few samples later: an unchanged copy is the same measure.
+imu_mag_read_t ak8963_read_aux_data(const uint8_t *ext, float *mx, float *my, float *mz)
+{
+    static uint8_t last_ext[AK8963_AUX_LEN];
+    bool fresh = memcmp(ext, last_ext, AK8963_AUX_LEN) != 0 && ak8963_parse(ext);
+
+    memcpy(last_ext, ext, AK8963_AUX_LEN);
+    return ak8963_result(fresh, mx, my, mz);
+}
+
+// Back to the continuous measures, after a single measure mode
+static void ak8963_restart(void)
+{
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_MODE);
+    nrf_delay_ms(1);
+    last_valid = false;
+}
+
+// Self test: measure the field of the internal coil, then check it against the datasheet
+// range (16 bit output), on the values adjusted by the fuse ROM sensitivities (ASA)
+bool ak8963_self_test(void)
+{
+    uint8_t asa[3], st[AK8963_AUX_LEN];
+    float h[3];
+    bool pass;
+
+    // Sensitivity adjustment values, in the fuse ROM access mode
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_POWER_DOWN);
+    nrf_delay_ms(1);
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_16BIT | AK8963_FUSE_ROM);
+    i2c_read_bytes(AK8963_ADDRESS, AK8963_ASAX, 3, asa);
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_POWER_DOWN);
+    nrf_delay_ms(1);
+
+    // Self test mode, with the coil field on
+    i2c_write_byte(AK8963_ADDRESS, AK8963_ASTC, 0x40);
+    i2c_write_byte(AK8963_ADDRESS, AK8963_CNTL1, AK8963_16BIT | AK8963_SELF_TEST);
+    if (!ak8963_wait_ready(st)) {
+        i2c_write_byte(AK8963_ADDRESS, AK8963_ASTC, 0x00);
+        printf("AK8963 self test : no measure, FAILED\r\n");
+        ak8963_restart();
+        return false;
+    }
+    i2c_write_byte(AK8963_ADDRESS, AK8963_ASTC, 0x00);
+
+    for (int i = 0; i < 3; i++)
+        h[i] = (int16_t)(st[1 + 2 * i] | (st[2 + 2 * i] << 8)) * ((asa[i] - 128) * 0.5f / 128.0f + 1.0f);
+    pass = h[0] >= -200 && h[0] <= 200 && h[1] >= -200 && h[1] <= 200 && h[2] >= -3200 && h[2] <= -800;
+    printf("AK8963 self test : %f %f %f, %s\r\n", h[0], h[1], h[2], pass ? "passed" : "FAILED");
+
+    ak8963_restart();
+    return pass;
+}
+
+const imu_mag_ops_t ak8963_ops = {
+    .name       = "AK8963",
+    .probe      = ak8963_probe,
+    .init       = ak8963_init,
+    .read_raw   = ak8963_read_raw_data,
+    .read       = ak8963_read_data,
+    .aux_enable = ak8963_aux_enable,
+    .read_aux   = ak8963_read_aux_data,
+    .self_test  = ak8963_self_test,
+};
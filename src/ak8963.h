@@ -0,0 +1,26 @@
+#ifndef AK8963_H
+#define AK8963_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "imu_sensor.h"
+
+// AK8963, the compass of the MPU9250: same registers as the AK8975A, with 16 bit measures
+// and continuous measurement modes (8 or 100 Hz). Runs in 16 bit, 100 Hz continuous mode.
+
+// Driver operations, for the imu.c sensor sets
+extern const imu_mag_ops_t ak8963_ops;
+
+bool ak8963_probe(void);
+void ak8963_init(void);
+// Same semantics as the AK8975A functions (see ak8975a.h)
+bool ak8963_read_raw_data(int16_t *val);
+imu_mag_read_t ak8963_read_data(float *mx, float *my, float *mz);
+bool ak8963_self_test(void);
+
+// Auxiliary I2C master mode: ST1 to ST2, as copied by the MPU
+#define AK8963_AUX_LEN IMU_MAG_AUX_LEN
+void ak8963_aux_enable(bool enable);
+imu_mag_read_t ak8963_read_aux_data(const uint8_t *ext, float *mx, float *my, float *mz);
+
+#endif
@@ -1,6 +1,7 @@
 #include <stdint.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "ak8975a.h"
 #include "printf.h"
@@ -9,6 +10,9 @@
 #include "nordic_common.h"
 #include "app_error.h"
 #include "imu.h"
+#include "mpu9150.h"
+#include "high_res_timer.h"
+#include "mag_calibration.h"
 
 //Magnetometer Registers
 #define AK8975A_ADDRESS  0x0C
@@ -29,15 +33,24 @@
 #define AK8975A_ASAY     0x11  // Fuse ROM y-axis sensitivity adjustment value
 #define AK8975A_ASAZ     0x12  // Fuse ROM z-axis sensitivity adjustment value
 
+// True if a compass answers at the AK8975A address. The MPU must be in bypass mode.
+bool ak8975a_probe(void)
+{
+    uint8_t whoami;
+
+    return i2c_read_bytes(AK8975A_ADDRESS, WHO_AM_I_AK8975A, 1, &whoami) == 0 && whoami == 0x48;
+}
+
 // Init magnetometer.
 // MUST be called AFTER mpu9150 init !
 void ak8975a_init()
 {
     // Check if magnometer is online
-    uint8_t whoami = i2c_read_byte(AK8975A_ADDRESS, WHO_AM_I_AK8975A);
+    uint8_t whoami = 0;
+    int err = i2c_read_byte(AK8975A_ADDRESS, WHO_AM_I_AK8975A, &whoami);
     printf("AK8975A : I am 0x%x\n\r", whoami);
 
-    if (whoami != 0x48) {
+    if (err || whoami != 0x48) {
         // WHO_AM_I should be 0x48
         printf("ERROR : I SHOULD BE 0x48\n\r");
         APP_ERROR_CHECK_BOOL(false);
@@ -49,43 +62,232 @@ void ak8975a_init()
     nrf_delay_ms(10);
 }
 
-void ak8975a_read_raw_data(int16_t *val)
+// Measures are 13 bit signed, a component at full scale means the field is out of range
+// (typically a magnet or some iron close to the sensor)
+#define AK8975A_FULL_SCALE 4095
+
+// Check for saturation and swap the axes. Returns false, leaving val untouched, if saturated.
+static bool ak8975a_convert(const int16_t *v, int16_t *val)
+{
+    for (int i = 0; i < 3; i++)
+        if (v[i] >= AK8975A_FULL_SCALE || v[i] <= -AK8975A_FULL_SCALE)
+            return false;
+
+    // WARNING, magnetometer axis are not the same as the accel / gyro ones
+    // Thus : x <--> y, and z <--> -z
+    val[0] = v[1];
+    val[1] = v[0];
+    val[2] = -v[2];
+    return true;
+}
+
+// Non-blocking measures: a single measurement is triggered, the fusion goes on, and the
+// result is collected by a later call once the conversion time is over (checked against the
+// high resolution timer, without any I2C access), then the next measurement is triggered
+// right away. Collecting costs a single burst read.
+#define AK8975A_MEASURE_TIME 9000UL     // us, max single measurement time
+
+static enum { AK8975A_IDLE, AK8975A_MEASURING } state = AK8975A_IDLE;
+static uint32_t triggered_at;
+
+static void ak8975a_trigger(uint32_t now)
 {
- start:
-    // Launch the first acquisition
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_CNTL, 0x01);
+    triggered_at = now;
+    state = AK8975A_MEASURING;
+}
+
+// Wait for the data ready bit of a blocking measure. False on a bus error, or if it never
+// comes.
+static bool ak8975a_wait_ready(void)
+{
+    uint32_t start = get_time();
+    uint8_t st1;
+
+    do {
+        if (i2c_read_byte(AK8975A_ADDRESS, AK8975A_ST1, &st1) != 0)
+            return false;
+        if (st1 & 0x01)
+            return true;
+    } while (get_time() - start < 2 * AK8975A_MEASURE_TIME);
+    return false;
+}
+
+// Let a non-blocking measurement end
+static void ak8975a_wait_measure(void)
+{
+    if (state == AK8975A_MEASURING)
+        while (get_time() - triggered_at < AK8975A_MEASURE_TIME) ;
+    state = AK8975A_IDLE;
+}
+
+// Do a single measurement, blocking until it is over (for the calibration, see
+// ak8975a_read_data() for the fusion). Returns false, leaving val untouched, if the sensor
+// reported an overflow or a data read error, or if the measure is saturated.
+bool ak8975a_read_raw_data(int16_t *val)
+{
+    int16_t v[3];
+    uint8_t st2;
+
+    // Don't write CNTL while a non-blocking measurement is running
+    ak8975a_wait_measure();
+
+    // Launch the acquisition
     i2c_write_byte(AK8975A_ADDRESS, AK8975A_CNTL, 0x01);
     //nrf_delay_ms(1);
 
     // Wait for a data to become available
-    while ((i2c_read_byte(AK8975A_ADDRESS, AK8975A_ST1) & 0x01) == 0);
-
-    // If there is no overflow
-    if((i2c_read_byte(AK8975A_ADDRESS, AK8975A_ST2) & 0x0C)==0) {
-        int16_t v[3];
-        // Read the six raw data registers sequentially into data array
-        // WARNING : code valid for little endian only !
-        i2c_read_bytes(AK8975A_ADDRESS, AK8975A_XOUT_L, 6, (uint8_t *)v);
-
-        // WARNING, magnetometer axis are not the same as the accel / gyro ones
-        // Thus : x <--> y, and z <--> -z
-        val[0] = v[1];
-        val[1] = v[0];
-        val[2] = -v[2];
-        return;
+    if (!ak8975a_wait_ready())
+        return false;
+
+    // Check for overflow or data read error
+    if (i2c_read_byte(AK8975A_ADDRESS, AK8975A_ST2, &st2) != 0 || (st2 & 0x0C) != 0)
+        return false;
+
+    // Read the six raw data registers sequentially into data array
+    // WARNING : code valid for little endian only !
+    if (i2c_read_bytes(AK8975A_ADDRESS, AK8975A_XOUT_L, 6, (uint8_t *)v) != 0)
+        return false;
+
+    return ak8975a_convert(v, val);
+}
+
+// Latest measure, shared by the non-blocking and the auxiliary I2C master modes: the compass
+// is slower than the fusion, so the same measure is used again until a new one comes in.
+static int16_t last_data[3];
+static bool last_valid = false;
+
+// Parse the AK8975A_AUX_LEN bytes from ST1 to ST2 into the latest measure. Returns true if
+// there was a new measure (ST1 data ready bit set).
+static bool ak8975a_parse(const uint8_t *st)
+{
+    int16_t v[3];
+
+    if ((st[0] & 0x01) == 0)
+        return false;
+
+    // WARNING : code valid for little endian only !
+    for (int i = 0; i < 3; i++)
+        v[i] = (int16_t)(st[1 + 2 * i] | (st[2 + 2 * i] << 8));
+
+    // Overflow or data read error in ST2
+    last_valid = (st[7] & 0x0C) == 0 && ak8975a_convert(v, last_data);
+    return true;
+}
+
+// Result of a non-blocking read, fresh if a new measure was just parsed
+static imu_mag_read_t ak8975a_result(bool fresh, float *mx, float *my, float *mz)
+{
+    if (!last_valid)
+        return fresh ? IMU_MAG_INVALID : IMU_MAG_NONE;
+
+    mag_calibration_correct(last_data, mx, my, mz);
+    return fresh ? IMU_MAG_NEW : IMU_MAG_SAME;
+}
+
+imu_mag_read_t ak8975a_read_data(float *mx, float *my, float *mz)
+{
+    uint8_t st[AK8975A_AUX_LEN];
+    uint32_t now = get_time();
+    bool fresh = false;
+
+    if (state == AK8975A_IDLE) {
+        last_valid = false;
+        ak8975a_trigger(now);
+    }
+    else if (now - triggered_at >= AK8975A_MEASURE_TIME) {
+        if (now - triggered_at > IMU_MAG_MAX_AGE) {
+            // Nobody asked for a while: this measure is outdated, and so is the last one
+            last_valid = false;
+            ak8975a_trigger(now);
+        }
+        else {
+            if (i2c_read_bytes(AK8975A_ADDRESS, AK8975A_ST1, AK8975A_AUX_LEN, st) == 0 && ak8975a_parse(st)) {
+                ak8975a_trigger(now);
+                fresh = true;
+            }
+            // else not ready yet, try again next time
+        }
     }
 
-    goto start;
+    return ak8975a_result(fresh, mx, my, mz);
 }
 
+// Auxiliary I2C master mode (MPU9150_AUX_MAG build): the MPU9150 itself reads ST1 to ST2
+// (slave 0), then triggers the next single measurement (slave 1). A measure takes up to
+// 9 ms, so the compass is only accessed once every few samples (every other one, 100 Hz, at
+// the 200 Hz MPU rate). Enable it again after a sample rate change.
+// When disabled, the compass is reached in bypass mode again, as by ak8975a_read_raw_data().
+void ak8975a_aux_enable(bool enable)
+{
+    if (enable) {
+        uint32_t period = mpu9150_sample_period();
 
-void ak8975a_read_data(float *mx, float *my, float *mz)
+        mpu9150_aux_read_setup(0, AK8975A_ADDRESS, AK8975A_ST1, AK8975A_AUX_LEN);
+        mpu9150_aux_write_setup(1, AK8975A_ADDRESS, AK8975A_CNTL, 0x01);
+        mpu9150_aux_rate(0x03, (AK8975A_MEASURE_TIME + period - 1) / period - 1);
+    }
+    else
+        state = AK8975A_IDLE;   // the MPU may have left a measurement running
+    last_valid = false;
+    mpu9150_aux_master_enable(enable);
+}
+
+// Same as ak8975a_read_data(), from the AK8975A_AUX_LEN bytes (ST1 to ST2) copied by the
+// MPU9150 into its EXT_SENS_DATA registers. The MPU9150 keeps its copy until it reads the
+// compass again, a few samples later: an unchanged copy is the same measure.
+imu_mag_read_t ak8975a_read_aux_data(const uint8_t *ext, float *mx, float *my, float *mz)
+{
+    static uint8_t last_ext[AK8975A_AUX_LEN];
+    bool fresh = memcmp(ext, last_ext, AK8975A_AUX_LEN) != 0 && ak8975a_parse(ext);
+
+    memcpy(last_ext, ext, AK8975A_AUX_LEN);
+    return ak8975a_result(fresh, mx, my, mz);
+}
+
+// Self test: measure the field of the internal coil, then check it against the datasheet
+// range, on the values adjusted by the fuse ROM sensitivities (ASA)
+bool ak8975a_self_test(void)
 {
-    static int16_t data[3];
-    ak8975a_read_raw_data(data);
-    float x = data[0] - cal.mag_offset[0];
-    float y = data[1] - cal.mag_offset[1];
-    float z = data[2] - cal.mag_offset[2];
-    *mx = x*cal.mag_scale[0] + y*cal.mag_scale[1] + z*cal.mag_scale[2];
-    *my = x*cal.mag_scale[3] + y*cal.mag_scale[4] + z*cal.mag_scale[5];
-    *mz = x*cal.mag_scale[6] + y*cal.mag_scale[7] + z*cal.mag_scale[8];
+    uint8_t asa[3];
+    int16_t v[3];
+    float h[3];
+    bool pass;
+
+    ak8975a_wait_measure();
+    last_valid = false;
+
+    // Sensitivity adjustment values, in the fuse ROM access mode
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_CNTL, 0x0F);
+    i2c_read_bytes(AK8975A_ADDRESS, AK8975A_ASAX, 3, asa);
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_CNTL, 0x00);
+
+    // Self test mode, with the coil field on
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_ASTC, 0x40);
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_CNTL, 0x08);
+    if (!ak8975a_wait_ready()) {
+        i2c_write_byte(AK8975A_ADDRESS, AK8975A_ASTC, 0x00);
+        printf("AK8975A self test : no measure, FAILED\r\n");
+        return false;
+    }
+    // WARNING : code valid for little endian only !
+    i2c_read_bytes(AK8975A_ADDRESS, AK8975A_XOUT_L, 6, (uint8_t *)v);
+    i2c_write_byte(AK8975A_ADDRESS, AK8975A_ASTC, 0x00);
+
+    for (int i = 0; i < 3; i++)
+        h[i] = v[i] * ((asa[i] - 128) * 0.5f / 128.0f + 1.0f);
+    pass = h[0] >= -100 && h[0] <= 100 && h[1] >= -100 && h[1] <= 100 && h[2] >= -1000 && h[2] <= -300;
+    printf("AK8975A self test : %f %f %f, %s\r\n", h[0], h[1], h[2], pass ? "passed" : "FAILED");
+    return pass;
 }
+
+const imu_mag_ops_t ak8975a_ops = {
+    .name       = "AK8975A",
+    .probe      = ak8975a_probe,
+    .init       = ak8975a_init,
+    .read_raw   = ak8975a_read_raw_data,
+    .read       = ak8975a_read_data,
+    .aux_enable = ak8975a_aux_enable,
+    .read_aux   = ak8975a_read_aux_data,
+    .self_test  = ak8975a_self_test,
+};
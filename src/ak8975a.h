@@ -1,9 +1,26 @@
 #ifndef AK8975A_H
 #define AK8975A_H
 
+#include <stdint.h>
+#include <stdbool.h>
+#include "imu_sensor.h"
+
+// Driver operations, for the imu.c sensor sets
+extern const imu_mag_ops_t ak8975a_ops;
+
+bool ak8975a_probe(void);
 void ak8975a_init(void);
-void ak8975a_read_raw_data(int16_t *val);
-void ak8975a_read_data(float *mx, float *my, float *mz);
+// ak8975a_read_raw_data() blocks for a whole measurement, and returns false when it is
+// unusable (overflow, saturation). ak8975a_read_data() does not block: it returns the latest
+// measure, telling a new one from the same one again (see imu_mag_read_t).
+bool ak8975a_read_raw_data(int16_t *val);
+imu_mag_read_t ak8975a_read_data(float *mx, float *my, float *mz);
 void ak8975a_calibrate(void);
+bool ak8975a_self_test(void);
+
+// Auxiliary I2C master mode: ST1 to ST2, as copied by the MPU9150
+#define AK8975A_AUX_LEN IMU_MAG_AUX_LEN
+void ak8975a_aux_enable(bool enable);
+imu_mag_read_t ak8975a_read_aux_data(const uint8_t *ext, float *mx, float *my, float *mz);
 
 #endif
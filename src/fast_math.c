@@ -0,0 +1,75 @@
+#include <stdint.h>
+
+#include "fast_math.h"
+
+// The seed comes from the float exponent and mantissa bits (the "magic constant" trick,
+// max relative error 3.4e-2), then each Newton iteration roughly squares the error:
+// 1.8e-3 after one, 4.8e-6 after two, 1.5e-7 (float rounding) after three, measured
+// over [1e-6, 1e6].
+// Three iterations are needed: the tilt bound given in fast_math.h is 0.18 deg after two
+// iterations but only 0.03 deg after three.
+// This costs 9 soft-float multiplies, against a sqrt() and a division.
+float inv_sqrt(float x)
+{
+    union { float f; uint32_t u; } bits = { .f = x };
+    float y;
+
+    bits.u = 0x5f3759df - (bits.u >> 1);
+    y = bits.f;
+    x *= 0.5f;
+    y = y * (1.5f - x * y * y);
+    y = y * (1.5f - x * y * y);
+    y = y * (1.5f - x * y * y);
+    return y;
+}
+
+// Minimax polynomial of atan(z) on [0, 1], max error 1e-5 rad (0.1 unit), then scaled to
+// angle units. Larger ratios use atan(z) = pi/2 - atan(1/z), and the quadrant comes from
+// the signs, so the whole atan2 costs one division and 7 multiplies.
+#define ANGLE16_PER_RAD 10430.378f  // 32768 / pi
+
+static float atan_unit(float z)
+{
+    float z2 = z * z;
+
+    return z * (0.9998660f + z2 * (-0.3302995f + z2 * (0.1801410f + z2 * (-0.0851330f + z2 * 0.0208351f))))
+           * ANGLE16_PER_RAD;
+}
+
+int16_t atan2_angle16(float y, float x)
+{
+    float abs_x = x < 0.0f ? -x : x;
+    float abs_y = y < 0.0f ? -y : y;
+    float a;
+    int32_t res;
+
+    if (abs_x == 0.0f && abs_y == 0.0f)
+        return 0;
+
+    if (abs_y <= abs_x)
+        a = atan_unit(abs_y / abs_x);
+    else
+        a = 16384.0f - atan_unit(abs_x / abs_y);
+    if (x < 0.0f)
+        a = 32768.0f - a;
+
+    // +180 deg is the same as -180 deg: 32768 wraps to -32768
+    res = (int32_t)(a + 0.5f);
+    return (int16_t)(uint16_t)(y < 0.0f ? -res : res);
+}
+
+// asin(x) = atan2(x, sqrt(1 - x^2))
+int16_t asin_angle16(float x)
+{
+    float c2 = 1.0f - x * x;
+
+    if (c2 <= 0.0f)
+        return x < 0.0f ? -16384 : 16384;
+    return atan2_angle16(x, c2 * inv_sqrt(c2));
+}
+
+int32_t float_to_fixed(float x, int frac_bits)
+{
+    x *= (float)(1L << frac_bits);
+    return (int32_t)(x < 0.0f ? x - 0.5f : x + 0.5f);
+}
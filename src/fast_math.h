@@ -0,0 +1,28 @@
+#ifndef FAST_MATH_H
+#define FAST_MATH_H
+
+#include <stdint.h>
+
+// Fast approximations of the libm functions used by the fusion code, which are
+// expensive soft-float calls on the Cortex-M0.
+
+// 1/sqrt(x) for x > 0, relative error below INV_SQRT_MAX_ERROR (x = 0 returns a huge value,
+// not inf). The filters drive the estimated gravity and field towards the normalised
+// measures, so a length error e on those tilts the estimate by sqrt(2 e) rad: 0.03 deg here.
+#define INV_SQRT_MAX_ERROR 2e-7f
+float inv_sqrt(float x);
+
+// Angles as signed 16 bit fractions of a turn (65536 per 360 deg, the advertising format),
+// so that they wrap around for free. Max error 1 unit (0.0055 deg) against the rounded libm
+// result, without any libm call.
+#define ANGLE16_PER_DEG (65536.0f / 360.0f)
+
+// atan2(y, x) in [-32768, 32767], 0 when both are null
+int16_t atan2_angle16(float y, float x);
+// asin(x) in [-16384, 16384], x is clamped to [-1, 1]
+int16_t asin_angle16(float x);
+
+// Round x * 2^frac_bits to the nearest integer, to precompute fixed-point coefficients
+int32_t float_to_fixed(float x, int frac_bits);
+
+#endif
@@ -1,6 +1,5 @@
 #include "fusion.h"
-
-#include <math.h>
+#include "fast_math.h"
 
 
 // Implementation of Sebastian Madgwick's "...efficient orientation filter for... inertial/magnetic sensor arrays"
@@ -10,38 +9,57 @@
 // The performance of the orientation filter is at least as good as conventional Kalman-based filtering algorithms
 // but is much less computationally intensive---it can be performed on a 3.3 V Pro Mini operating at 8 MHz!
 
-// GyroMeasError = 1.0471975511965976f;
-// Beta = sqrt(3.0f / 4.0f) * GyroMeasError;
-static float beta = 0.3068996821171088f; // XXX FIXME 0.9
-
 // GyroMeasDrift = 0.017453292519943295f;
 // Compute zeta, the other free parameter in the Madgwick scheme usually set to a small or zero value
 // Zeta = sqrt(3.0f / 4.0f) * GyroMeasDrift;
 // static float zeta = 0.015114994701951814f;
 
 
-void madgwick_quaternion_update(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt, float *q)
+// Reference direction of Earth's magnetic field (_2bx, _2bz), from the normalised magnetometer
+// measurement and the current orientation
+static inline void madgwick_reference(const float *q, float mx, float my, float mz, float *_2bx, float *_2bz)
+{
+    float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+    float norm;
+    float hx, hy;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    float _2q1mx = 2.0f * q1 * mx;
+    float _2q1my = 2.0f * q1 * my;
+    float _2q1mz = 2.0f * q1 * mz;
+    float _2q2mx = 2.0f * q2 * mx;
+    float _2q2 = 2.0f * q2;
+    float _2q3 = 2.0f * q3;
+    float q1q1 = q1 * q1;
+    float q2q2 = q2 * q2;
+    float q3q3 = q3 * q3;
+    float q4q4 = q4 * q4;
+
+    hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
+    hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
+    norm = hx * hx + hy * hy;
+    *_2bx = norm * inv_sqrt(norm);
+    *_2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
+}
+
+// One gradient descent step, with normalised accelerometer and magnetometer measurements.
+// The quaternion is left unnormalised, the caller does it.
+static inline void madgwick_step(float *q, float beta, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float _2bx, float _2bz, float dt)
 {
     float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
     float norm;
-    float hx, hy, _2bx, _2bz;
     float s1, s2, s3, s4;
     float qDot1, qDot2, qDot3, qDot4;
 
     // Auxiliary variables to avoid repeated arithmetic
-    float _2q1mx;
-    float _2q1my;
-    float _2q1mz;
-    float _2q2mx;
-    float _4bx;
-    float _4bz;
+    float _4bx = 2.0f * _2bx;
+    float _4bz = 2.0f * _2bz;
     float _2q1 = 2.0f * q1;
     float _2q2 = 2.0f * q2;
     float _2q3 = 2.0f * q3;
     float _2q4 = 2.0f * q4;
     float _2q1q3 = 2.0f * q1 * q3;
     float _2q3q4 = 2.0f * q3 * q4;
-    float q1q1 = q1 * q1;
     float q1q2 = q1 * q2;
     float q1q3 = q1 * q3;
     float q1q4 = q1 * q4;
@@ -52,45 +70,157 @@ void madgwick_quaternion_update(float ax, float ay, float az, float gx, float gy
     float q3q4 = q3 * q4;
     float q4q4 = q4 * q4;
 
+    // Gradient decent algorithm corrective step
+    s1 = -_2q3 * (2.0f * q2q4 - _2q1q3 - ax) + _2q2 * (2.0f * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+    s2 = _2q4 * (2.0f * q2q4 - _2q1q3 - ax) + _2q1 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q2 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + _2bz * q4 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+    s3 = -_2q1 * (2.0f * q2q4 - _2q1q3 - ax) + _2q4 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q3 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+    s4 = _2q2 * (2.0f * q2q4 - _2q1q3 - ax) + _2q3 * (2.0f * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
+    norm = inv_sqrt(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
+    s1 *= norm;
+    s2 *= norm;
+    s3 *= norm;
+    s4 *= norm;
+
+    // Compute rate of change of quaternion
+    qDot1 = 0.5f * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
+    qDot2 = 0.5f * (q1 * gx + q3 * gz - q4 * gy) - beta * s2;
+    qDot3 = 0.5f * (q1 * gy - q2 * gz + q4 * gx) - beta * s3;
+    qDot4 = 0.5f * (q1 * gz + q2 * gy - q3 * gx) - beta * s4;
+
+    // Integrate to yield quaternion
+    q[0] = q1 + qDot1 * dt;
+    q[1] = q2 + qDot2 * dt;
+    q[2] = q3 + qDot3 * dt;
+    q[3] = q4 + qDot4 * dt;
+}
+
+static inline void normalise_quaternion(float *q)
+{
+    float norm = inv_sqrt(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    q[0] *= norm;
+    q[1] *= norm;
+    q[2] *= norm;
+    q[3] *= norm;
+}
+
+void madgwick_quaternion_update(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt)
+{
+    float norm;
+    float _2bx, _2bz;
+
     // Normalise accelerometer measurement
-    norm = sqrt(ax * ax + ay * ay + az * az);
+    norm = ax * ax + ay * ay + az * az;
     if (norm == 0.0f) return; // handle NaN
-    norm = 1.0f/norm;
+    norm = inv_sqrt(norm);
     ax *= norm;
     ay *= norm;
     az *= norm;
 
     // Normalise magnetometer measurement
-    norm = sqrt(mx * mx + my * my + mz * mz);
+    norm = mx * mx + my * my + mz * mz;
     if (norm == 0.0f) return; // handle NaN
-    norm = 1.0f/norm;
+    norm = inv_sqrt(norm);
     mx *= norm;
     my *= norm;
     mz *= norm;
 
-    // Reference direction of Earth's magnetic field
-    _2q1mx = 2.0f * q1 * mx;
-    _2q1my = 2.0f * q1 * my;
-    _2q1mz = 2.0f * q1 * mz;
-    _2q2mx = 2.0f * q2 * mx;
-    hx = mx * q1q1 - _2q1my * q4 + _2q1mz * q3 + mx * q2q2 + _2q2 * my * q3 + _2q2 * mz * q4 - mx * q3q3 - mx * q4q4;
-    hy = _2q1mx * q4 + my * q1q1 - _2q1mz * q2 + _2q2mx * q3 - my * q2q2 + my * q3q3 + _2q3 * mz * q4 - my * q4q4;
-    _2bx = sqrt(hx * hx + hy * hy);
-    _2bz = -_2q1mx * q3 + _2q1my * q2 + mz * q1q1 + _2q2mx * q4 - mz * q2q2 + _2q3 * my * q4 - mz * q3q3 + mz * q4q4;
-    _4bx = 2.0f * _2bx;
-    _4bz = 2.0f * _2bz;
+    madgwick_reference(f->q, mx, my, mz, &_2bx, &_2bz);
+    madgwick_step(f->q, f->beta, ax, ay, az, gx, gy, gz, mx, my, mz, _2bx, _2bz, dt);
+    normalise_quaternion(f->q);
+}
+
+// Same filter over a block of samples (e.g. read from the MPU FIFO) sharing the latest
+// magnetometer measurement. The mag normalisation, the Earth field reference and the
+// quaternion normalisation are done once per block instead of once per sample: within a
+// short block the orientation changes too little for it to matter, and each step keeps |q|
+// within dt^2 of 1. The same (latest) mag measurement is used for every sample: bringing it
+// back to the earlier sample frames with the gyro was tried, and made the estimate at the end
+// of the block worse (fusion bench, 4 samples per block).
+void madgwick_quaternion_update_batch(fusion_t *f, const fusion_sample_t *samples, int n, float mx, float my, float mz)
+{
+    float norm;
+    float ax, ay, az;
+    float _2bx, _2bz;
+
+    if (n <= 0)
+        return;
+
+    // Normalise magnetometer measurement
+    norm = mx * mx + my * my + mz * mz;
+    if (norm == 0.0f) return; // handle NaN
+    norm = inv_sqrt(norm);
+    mx *= norm;
+    my *= norm;
+    mz *= norm;
+
+    madgwick_reference(f->q, mx, my, mz, &_2bx, &_2bz);
+
+    for (int i = 0; i < n; i++) {
+        const fusion_sample_t *s = &samples[i];
+
+        // Normalise accelerometer measurement
+        norm = s->ax * s->ax + s->ay * s->ay + s->az * s->az;
+        if (norm == 0.0f) continue; // handle NaN
+        norm = inv_sqrt(norm);
+        ax = s->ax * norm;
+        ay = s->ay * norm;
+        az = s->az * norm;
+
+        madgwick_step(f->q, f->beta, ax, ay, az, s->gx, s->gy, s->gz, mx, my, mz, _2bx, _2bz, s->dt);
+    }
+    normalise_quaternion(f->q);
+}
+
+
+// 6 DOF version (accel and gyro only), for when the magnetometer can't be trusted. Same
+// gradient step with the magnetic terms dropped, so the heading is only integrated from the gyro.
+void madgwick_imu_update(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float dt)
+{
+    float *q = f->q;
+    float beta = f->beta;
+    float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+    float norm;
+    float fg1, fg2, fg3;
+    float s1, s2, s3, s4;
+    float qDot1, qDot2, qDot3, qDot4;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    float _2q1 = 2.0f * q1;
+    float _2q2 = 2.0f * q2;
+    float _2q3 = 2.0f * q3;
+    float _2q4 = 2.0f * q4;
+    float _4q2 = 4.0f * q2;
+    float _4q3 = 4.0f * q3;
+
+    // Normalise accelerometer measurement
+    norm = ax * ax + ay * ay + az * az;
+    if (norm == 0.0f) return; // handle NaN
+    norm = inv_sqrt(norm);
+    ax *= norm;
+    ay *= norm;
+    az *= norm;
+
+    // Objective function
+    fg1 = 2.0f * (q2 * q4 - q1 * q3) - ax;
+    fg2 = 2.0f * (q1 * q2 + q3 * q4) - ay;
+    fg3 = 1.0f - 2.0f * (q2 * q2 + q3 * q3) - az;
 
     // Gradient decent algorithm corrective step
-    s1 = -_2q3 * (2.0f * q2q4 - _2q1q3 - ax) + _2q2 * (2.0f * q1q2 + _2q3q4 - ay) - _2bz * q3 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q4 + _2bz * q2) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q3 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-    s2 = _2q4 * (2.0f * q2q4 - _2q1q3 - ax) + _2q1 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q2 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + _2bz * q4 * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q3 + _2bz * q1) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q4 - _4bz * q2) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-    s3 = -_2q1 * (2.0f * q2q4 - _2q1q3 - ax) + _2q4 * (2.0f * q1q2 + _2q3q4 - ay) - 4.0f * q3 * (1.0f - 2.0f * q2q2 - 2.0f * q3q3 - az) + (-_4bx * q3 - _2bz * q1) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (_2bx * q2 + _2bz * q4) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + (_2bx * q1 - _4bz * q3) * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-    s4 = _2q2 * (2.0f * q2q4 - _2q1q3 - ax) + _2q3 * (2.0f * q1q2 + _2q3q4 - ay) + (-_4bx * q4 + _2bz * q2) * (_2bx * (0.5f - q3q3 - q4q4) + _2bz * (q2q4 - q1q3) - mx) + (-_2bx * q1 + _2bz * q3) * (_2bx * (q2q3 - q1q4) + _2bz * (q1q2 + q3q4) - my) + _2bx * q2 * (_2bx * (q1q3 + q2q4) + _2bz * (0.5f - q2q2 - q3q3) - mz);
-    norm = sqrt(s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4);    // normalise step magnitude
-    norm = 1.0f/norm;
-    s1 *= norm;
-    s2 *= norm;
-    s3 *= norm;
-    s4 *= norm;
+    s1 = -_2q3 * fg1 + _2q2 * fg2;
+    s2 = _2q4 * fg1 + _2q1 * fg2 - _4q2 * fg3;
+    s3 = -_2q1 * fg1 + _2q4 * fg2 - _4q3 * fg3;
+    s4 = _2q2 * fg1 + _2q3 * fg2;
+    norm = s1 * s1 + s2 * s2 + s3 * s3 + s4 * s4;
+    if (norm == 0.0f) {
+        s1 = s2 = s3 = s4 = 0.0f;   // already at the minimum
+    }
+    else {
+        norm = inv_sqrt(norm);    // normalise step magnitude
+        s1 *= norm;
+        s2 *= norm;
+        s3 *= norm;
+        s4 *= norm;
+    }
 
     // Compute rate of change of quaternion
     qDot1 = 0.5f * (-q2 * gx - q3 * gy - q4 * gz) - beta * s1;
@@ -103,29 +233,22 @@ void madgwick_quaternion_update(float ax, float ay, float az, float gx, float gy
     q2 += qDot2 * dt;
     q3 += qDot3 * dt;
     q4 += qDot4 * dt;
-    norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
-    norm = 1.0f/norm;
+    norm = inv_sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);    // normalise quaternion
     q[0] = q1 * norm;
     q[1] = q2 * norm;
     q[2] = q3 * norm;
     q[3] = q4 * norm;
-
 }
 
 
 
 // Similar to Madgwick scheme but uses proportional and integral filtering on the error between estimated reference vectors and
 // measured ones.
-// these are the free parameters in the Mahony filter and fusion scheme, Kp for proportional feedback,
-// Ki for integral
-#define Kp (2.0f * 5.0f)
-#define Ki (0.1f)
-
-void mahony_quaternion_update(float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt, float *q)
+void mahony_quaternion_update(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt)
 {
-    // Vector to hold integral error for Mahony method
-    static float eInt[3] = {0.0f, 0.0f, 0.0f};
-
+    float *q = f->q;
+    float *eInt = f->eInt;      // integral error
+    float Kp = f->kp, Ki = f->ki;
     float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
     float norm;
     float hx, hy, bx, bz;
@@ -146,17 +269,17 @@ void mahony_quaternion_update(float ax, float ay, float az, float gx, float gy,
     float q4q4 = q4 * q4;
 
     // Normalise accelerometer measurement
-    norm = sqrt(ax * ax + ay * ay + az * az);
+    norm = ax * ax + ay * ay + az * az;
     if (norm == 0.0f) return; // handle NaN
-    norm = 1.0f / norm;        // use reciprocal for division
+    norm = inv_sqrt(norm);     // use reciprocal for division
     ax *= norm;
     ay *= norm;
     az *= norm;
 
     // Normalise magnetometer measurement
-    norm = sqrt(mx * mx + my * my + mz * mz);
+    norm = mx * mx + my * my + mz * mz;
     if (norm == 0.0f) return; // handle NaN
-    norm = 1.0f / norm;        // use reciprocal for division
+    norm = inv_sqrt(norm);     // use reciprocal for division
     mx *= norm;
     my *= norm;
     mz *= norm;
@@ -164,7 +287,8 @@ void mahony_quaternion_update(float ax, float ay, float az, float gx, float gy,
     // Reference direction of Earth's magnetic field
     hx = 2.0f * mx * (0.5f - q3q3 - q4q4) + 2.0f * my * (q2q3 - q1q4) + 2.0f * mz * (q2q4 + q1q3);
     hy = 2.0f * mx * (q2q3 + q1q4) + 2.0f * my * (0.5f - q2q2 - q4q4) + 2.0f * mz * (q3q4 - q1q2);
-    bx = sqrt((hx * hx) + (hy * hy));
+    norm = (hx * hx) + (hy * hy);
+    bx = norm * inv_sqrt(norm);
     bz = 2.0f * mx * (q2q4 - q1q3) + 2.0f * my * (q3q4 + q1q2) + 2.0f * mz * (0.5f - q2q2 - q3q3);
 
     // Estimated direction of gravity and magnetic field
@@ -207,10 +331,217 @@ void mahony_quaternion_update(float ax, float ay, float az, float gx, float gy,
     q4 = pc + (q1 * gz + pa * gy - pb * gx) * (0.5f * dt);
 
     // Normalise quaternion
-    norm = sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
-    norm = 1.0f / norm;
+    norm = inv_sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
     q[0] = q1 * norm;
     q[1] = q2 * norm;
     q[2] = q3 * norm;
     q[3] = q4 * norm;
 }
+
+// 6 DOF version of the Mahony filter: the feedback only comes from gravity
+void mahony_imu_update(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float dt)
+{
+    float *q = f->q;
+    float *eInt = f->eInt;      // integral error
+    float Kp = f->kp, Ki = f->ki;
+    float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];   // short name local variable for readability
+    float norm;
+    float vx, vy, vz;
+    float ex, ey, ez;
+    float pa, pb, pc;
+
+    // Normalise accelerometer measurement
+    norm = ax * ax + ay * ay + az * az;
+    if (norm == 0.0f) return; // handle NaN
+    norm = inv_sqrt(norm);     // use reciprocal for division
+    ax *= norm;
+    ay *= norm;
+    az *= norm;
+
+    // Estimated direction of gravity
+    vx = 2.0f * (q2 * q4 - q1 * q3);
+    vy = 2.0f * (q1 * q2 + q3 * q4);
+    vz = q1 * q1 - q2 * q2 - q3 * q3 + q4 * q4;
+
+    // Error is cross product between estimated direction and measured direction of gravity
+    ex = ay * vz - az * vy;
+    ey = az * vx - ax * vz;
+    ez = ax * vy - ay * vx;
+    if (Ki > 0.0f)
+        {
+            eInt[0] += ex;      // accumulate integral error
+            eInt[1] += ey;
+            eInt[2] += ez;
+        }
+    else
+        {
+            eInt[0] = 0.0f;     // prevent integral wind up
+            eInt[1] = 0.0f;
+            eInt[2] = 0.0f;
+        }
+
+    // Apply feedback terms
+    gx = gx + Kp * ex + Ki * eInt[0];
+    gy = gy + Kp * ey + Ki * eInt[1];
+    gz = gz + Kp * ez + Ki * eInt[2];
+
+    // Integrate rate of change of quaternion
+    pa = q2;
+    pb = q3;
+    pc = q4;
+    q1 = q1 + (-q2 * gx - q3 * gy - q4 * gz) * (0.5f * dt);
+    q2 = pa + (q1 * gx + pb * gz - pc * gy) * (0.5f * dt);
+    q3 = pb + (q1 * gy - pa * gz + pc * gx) * (0.5f * dt);
+    q4 = pc + (q1 * gz + pa * gy - pb * gx) * (0.5f * dt);
+
+    // Normalise quaternion
+    norm = inv_sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
+    q[0] = q1 * norm;
+    q[1] = q2 * norm;
+    q[2] = q3 * norm;
+    q[3] = q4 * norm;
+}
+
+
+void fusion_reset(fusion_t *f)
+{
+    f->q[0] = 1.0f;
+    f->q[1] = 0.0f;
+    f->q[2] = 0.0f;
+    f->q[3] = 0.0f;
+    f->eInt[0] = 0.0f;
+    f->eInt[1] = 0.0f;
+    f->eInt[2] = 0.0f;
+    f->heading[0] = 1.0f;
+    f->heading[1] = 0.0f;
+}
+
+void fusion_init(fusion_t *f, fusion_algo_t algo)
+{
+    f->algo = algo;
+    f->beta = MADGWICK_BETA;
+    f->kp = MAHONY_KP;
+    f->ki = MAHONY_KI;
+    fusion_reset(f);
+}
+
+void fusion_update(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt)
+{
+    switch (f->algo) {
+    case FUSION_MADGWICK:
+        madgwick_quaternion_update(f, ax, ay, az, gx, gy, gz, mx, my, mz, dt);
+        break;
+    case FUSION_MADGWICK_FIXED:
+        madgwick_quaternion_update_fixed(f, ax, ay, az, gx, gy, gz, mx, my, mz, dt);
+        break;
+    case FUSION_MAHONY:
+        mahony_quaternion_update(f, ax, ay, az, gx, gy, gz, mx, my, mz, dt);
+        break;
+    }
+}
+
+void fusion_update_batch(fusion_t *f, const fusion_sample_t *samples, int n, float mx, float my, float mz)
+{
+    // Only Madgwick has a batched version, the others go sample by sample
+    if (f->algo == FUSION_MADGWICK) {
+        madgwick_quaternion_update_batch(f, samples, n, mx, my, mz);
+        return;
+    }
+    for (int i = 0; i < n; i++)
+        fusion_update(f, samples[i].ax, samples[i].ay, samples[i].az,
+                      samples[i].gx, samples[i].gy, samples[i].gz, mx, my, mz, samples[i].dt);
+}
+
+void fusion_update_imu(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float dt)
+{
+    switch (f->algo) {
+    case FUSION_MADGWICK:
+        madgwick_imu_update(f, ax, ay, az, gx, gy, gz, dt);
+        break;
+    case FUSION_MADGWICK_FIXED:
+        madgwick_imu_update_fixed(f, ax, ay, az, gx, gy, gz, dt);
+        break;
+    case FUSION_MAHONY:
+        mahony_imu_update(f, ax, ay, az, gx, gy, gz, dt);
+        break;
+    }
+}
+
+void fusion_predict(fusion_t *f, float gx, float gy, float gz, float dt)
+{
+    float *q = f->q;
+    float q1 = q[0], q2 = q[1], q3 = q[2], q4 = q[3];
+    float norm;
+
+    // Integrate rate of change of quaternion
+    dt *= 0.5f;
+    gx *= dt;
+    gy *= dt;
+    gz *= dt;
+    q1 += -q[1] * gx - q[2] * gy - q[3] * gz;
+    q2 +=  q[0] * gx + q[2] * gz - q[3] * gy;
+    q3 +=  q[0] * gy - q[1] * gz + q[3] * gx;
+    q4 +=  q[0] * gz + q[1] * gy - q[2] * gx;
+
+    // Normalise quaternion
+    norm = inv_sqrt(q1 * q1 + q2 * q2 + q3 * q3 + q4 * q4);
+    q[0] = q1 * norm;
+    q[1] = q2 * norm;
+    q[2] = q3 * norm;
+    q[3] = q4 * norm;
+}
+
+void fusion_correct(fusion_t *f, float ax, float ay, float az, float mx, float my, float mz, float dt)
+{
+    // With a null rotation rate, the filters only apply their accel / mag feedback, scaled by dt
+    fusion_update(f, ax, ay, az, 0.0f, 0.0f, 0.0f, mx, my, mz, dt);
+}
+
+void fusion_correct_imu(fusion_t *f, float ax, float ay, float az, float dt)
+{
+    fusion_update_imu(f, ax, ay, az, 0.0f, 0.0f, 0.0f, dt);
+}
+
+void fusion_update_heading(fusion_t *f, const float *qi)
+{
+    float c = f->heading[0], s = f->heading[1];
+
+    // Rotation about the vertical axis (c, 0, 0, s), applied in the earth frame: q = r * qi
+    f->q[0] = c * qi[0] - s * qi[3];
+    f->q[1] = c * qi[1] - s * qi[2];
+    f->q[2] = c * qi[2] + s * qi[1];
+    f->q[3] = c * qi[3] + s * qi[0];
+}
+
+void fusion_correct_heading(fusion_t *f, const float *qi, float mx, float my, float mz, float dt)
+{
+    float q1 = qi[0], q2 = qi[1], q3 = qi[2], q4 = qi[3];
+    float c = f->heading[0], s = f->heading[1];
+    float hx, hy, cp, sp, x, y, step, norm;
+
+    // Horizontal part of the magnetic field in the earth frame of qi (q * m * q', as in
+    // madgwick_reference())
+    hx = mx * (q1 * q1 + q2 * q2 - q3 * q3 - q4 * q4) + 2.0f * my * (q2 * q3 - q1 * q4) + 2.0f * mz * (q2 * q4 + q1 * q3);
+    hy = 2.0f * mx * (q1 * q4 + q2 * q3) + my * (q1 * q1 - q2 * q2 + q3 * q3 - q4 * q4) + 2.0f * mz * (q3 * q4 - q1 * q2);
+
+    // Turned by the current correction, it should point to x (north), the error is its angle
+    cp = c * c - s * s;
+    sp = 2.0f * c * s;
+    x = cp * hx - sp * hy;
+    y = sp * hx + cp * hy;
+    if (x == 0.0f && y == 0.0f)
+        return;
+
+    // Turn the half angle by -error * gain * dt / 2, at most by the whole error
+    step = HEADING_GAIN * dt;
+    if (step > 1.0f)
+        step = 1.0f;
+    step *= -0.5f * atan2_angle16(y, x) * (3.14159265f / 32768.0f);
+    c -= s * step;
+    s += f->heading[0] * step;
+    norm = inv_sqrt(c * c + s * s);
+    f->heading[0] = c * norm;
+    f->heading[1] = s * norm;
+
+    fusion_update_heading(f, qi);
+}
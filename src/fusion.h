@@ -3,16 +3,118 @@
 
 #include <stdint.h>
 
-void madgwick_quaternion_update(float ax, float ay, float az,
+// GyroMeasError = 1.0471975511965976f;
+// Beta = sqrt(3.0f / 4.0f) * GyroMeasError;
+#define MADGWICK_BETA 0.3068996821171088f // XXX FIXME 0.9
+
+// Default free parameters of the Mahony filter, Kp for proportional feedback, Ki for integral
+#define MAHONY_KP (2.0f * 5.0f)
+#define MAHONY_KI (0.1f)
+
+// Rate (1/s) at which the heading correction of an external 6 DOF orientation follows the mag
+#define HEADING_GAIN (1.0f)
+
+typedef enum {
+    FUSION_MADGWICK,
+    FUSION_MADGWICK_FIXED,  // Madgwick computed in fixed point (see fusion_fixed.c)
+    FUSION_MAHONY,
+} fusion_algo_t;
+
+// State of one filter instance. Several instances can run side by side, each one with its own
+// algorithm, gains and update rate.
+typedef struct {
+    fusion_algo_t algo;
+    float q[4];             // orientation quaternion
+    float beta;             // Madgwick gain
+    float kp, ki;           // Mahony gains
+    float eInt[3];          // Mahony integral error
+    float heading[2];       // cos and sin of half the heading correction (external 6 DOF input)
+} fusion_t;
+
+// One accel / gyro sample of a block, dt seconds after the previous one
+typedef struct {
+    float ax, ay, az;
+    float gx, gy, gz;
+    float dt;
+} fusion_sample_t;
+
+// Select the algorithm, set its default gains and reset the state
+void fusion_init(fusion_t *f, fusion_algo_t algo);
+// Forget the orientation (back to identity) and the integral error, keep the gains
+void fusion_reset(fusion_t *f);
+// Update the orientation with one sample of each sensor, dt seconds after the previous one
+void fusion_update(fusion_t *f,
+                   float ax, float ay, float az,
+                   float gx, float gy, float gz,
+                   float mx, float my, float mz,
+                   float dt);
+
+// Multi-rate use: propagate the orientation with the gyro only, on every sample...
+void fusion_predict(fusion_t *f, float gx, float gy, float gz, float dt);
+// ...and correct it with accel and mag at a lower rate, dt being the time since the previous
+// correction
+void fusion_correct(fusion_t *f,
+                    float ax, float ay, float az,
+                    float mx, float my, float mz,
+                    float dt);
+
+// Update the orientation with a block of n accel / gyro samples and the latest mag sample
+void fusion_update_batch(fusion_t *f,
+                         const fusion_sample_t *samples, int n,
+                         float mx, float my, float mz);
+
+// Same as fusion_update() and fusion_correct() without the magnetometer (6 DOF), for when its
+// data can't be trusted: the heading then drifts with the gyro, roll and pitch stay corrected
+void fusion_update_imu(fusion_t *f,
+                       float ax, float ay, float az,
+                       float gx, float gy, float gz,
+                       float dt);
+void fusion_correct_imu(fusion_t *f, float ax, float ay, float az, float dt);
+
+// Heading fusion on top of an external 6 DOF orientation qi (w, x, y, z), such as the MPU9150
+// DMP output: the orientation is qi turned about the vertical axis by a heading correction,
+// that fusion_correct_heading() pulls towards the magnetic north at HEADING_GAIN.
+void fusion_update_heading(fusion_t *f, const float *qi);
+void fusion_correct_heading(fusion_t *f, const float *qi, float mx, float my, float mz, float dt);
+
+void madgwick_quaternion_update(fusion_t *f,
+                                float ax, float ay, float az,
                                 float gx, float gy, float gz,
                                 float mx, float my, float mz,
-                                float dt,
-                                float *q);
+                                float dt);
+
+// Madgwick update over n accel / gyro samples and the latest mag sample (see fusion.c)
+void madgwick_quaternion_update_batch(fusion_t *f,
+                                      const fusion_sample_t *samples, int n,
+                                      float mx, float my, float mz);
 
-void mahony_quaternion_update(float ax, float ay, float az,
+// Same as the float versions, with the gradient step in fixed point (see fusion_fixed.c for
+// what it saves, the inputs and the state are still converted from and to float)
+void madgwick_quaternion_update_fixed(fusion_t *f,
+                                      float ax, float ay, float az,
+                                      float gx, float gy, float gz,
+                                      float mx, float my, float mz,
+                                      float dt);
+
+void mahony_quaternion_update(fusion_t *f,
+                              float ax, float ay, float az,
                               float gx, float gy, float gz,
                               float mx, float my, float mz,
-                              float dt,
-                              float *q);
+                              float dt);
+
+void madgwick_imu_update(fusion_t *f,
+                         float ax, float ay, float az,
+                         float gx, float gy, float gz,
+                         float dt);
+
+void madgwick_imu_update_fixed(fusion_t *f,
+                               float ax, float ay, float az,
+                               float gx, float gy, float gz,
+                               float dt);
+
+void mahony_imu_update(fusion_t *f,
+                       float ax, float ay, float az,
+                       float gx, float gy, float gz,
+                       float dt);
 
 #endif
@@ -0,0 +1,454 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+
+#include "fusion_bench.h"
+#include "fusion.h"
+#include "fast_math.h"
+#include "high_res_timer.h"
+#include "printf.h"
+
+#define BENCH_DT            0.005f  // 200 Hz, the MPU9150 output rate
+#define BENCH_CONVERGED_DEG 5.0f    // a filter has converged once its error stays below this
+                                    // (or below its max error threshold, if larger)
+#define BENCH_MAX_BATCH     8
+
+// Length of a get_time() tick: microseconds on the device, the host build uses nanoseconds
+#ifndef BENCH_TICK_NS
+#define BENCH_TICK_NS       1000
+#endif
+
+// Sensor models, in the units the firmware feeds the filters with (see mpu9150_read_data()
+// and ak8975a_read_data()): every sample is quantised to the sensor LSB after adding a
+// constant bias (what is left after calibration) and a white noise.
+//   MPU9150 accel, 2g range: 16384 LSB/g, 400 ug/sqrt(Hz) over the ~40 Hz DLPF bandwidth
+#define ACCEL_LSB_PER_G     16384.0f
+#define ACCEL_NOISE         0.004f          // g rms
+#define ACCEL_BIAS          0.01f           // g
+//   MPU9150 gyro, 250 deg/s range: 131 LSB/(deg/s), 0.005 deg/s/sqrt(Hz)
+#define GYRO_LSB_PER_RAD    (32768.0f / 250.0f * 180.0f / M_PI)
+#define GYRO_NOISE          (0.05f * M_PI / 180.0f)    // rad/s rms
+#define GYRO_BIAS           (0.3f * M_PI / 180.0f)     // rad/s
+//   AK8975A: 0.3 uT/LSB, 47 uT Earth field in Paris, i.e. 157 LSB
+#define MAG_FIELD           157.0f          // LSB
+#define MAG_NOISE           1.0f            // LSB rms
+#define MAG_BIAS            3.0f            // LSB
+
+// Motion profiles. Each one gives the body rates (rad/s) at time t, and may add a magnetic
+// disturbance (a nearby magnet, as a field in the Earth frame) over [disturb_from, disturb_to[.
+// The filters start 60 deg away from the ground truth, must converge, then their error
+// against the truth is measured from settle_from (see the baselines below).
+typedef struct {
+    const char *name;
+    float duration;
+    void (*rate)(float t, float *w);
+    float disturb_from, disturb_to;
+    float settle_from;
+} profile_t;
+
+static void rate_static(float t, float *w)
+{
+    w[0] = w[1] = w[2] = 0.0f;
+}
+
+// Turntable: constant rate around an axis tilted from the vertical
+static void rate_spin(float t, float *w)
+{
+    w[0] = 0.5f;
+    w[1] = 0.0f;
+    w[2] = 3.0f;
+}
+
+// Pendulum like swing, 1 Hz, +/-30 deg around x, with a slower yaw wobble
+static void rate_oscillation(float t, float *w)
+{
+    w[0] = 0.5236f * 2.0f * M_PI * cosf(2.0f * M_PI * t);
+    w[1] = 0.0f;
+    w[2] = 0.5f * sinf(0.5f * M_PI * t);
+}
+
+// Slow tumbling motion
+static void rate_tumble(float t, float *w)
+{
+    w[0] = 1.5f * sinf(0.3f * t);
+    w[1] = 1.0f * cosf(0.21f * t);
+    w[2] = 2.0f * sinf(0.13f * t + 1.0f);
+}
+
+static const profile_t profiles[] = {
+    {"static", 15.0f, rate_static, 0.0f, 0.0f, 8.0f},
+    {"spin", 15.0f, rate_spin, 0.0f, 0.0f, 8.0f},
+    {"oscillation", 15.0f, rate_oscillation, 0.0f, 0.0f, 8.0f},
+    {"tumble", 20.0f, rate_tumble, 0.0f, 0.0f, 10.0f},
+    {"mag_disturbance", 24.0f, rate_static, 8.0f, 10.0f, 18.0f},
+};
+#define PROFILE_COUNT (sizeof profiles / sizeof profiles[0])
+
+// A decimation of n > 1 runs the filter in multi-rate mode: gyro prediction on every sample,
+// accel / mag correction on one sample out of n.
+// A batch of n > 1 feeds the (Madgwick only) batch update with blocks of n samples and the
+// mag of the last one, as when reading the MPU FIFO.
+static const struct {
+    const char *name;
+    fusion_algo_t algo;
+    int decimation;
+    int batch;
+} filters[] = {
+    {"madgwick", FUSION_MADGWICK, 1, 1},
+    {"madgwick_fixed", FUSION_MADGWICK_FIXED, 1, 1},
+    {"mahony", FUSION_MAHONY, 1, 1},
+    {"madgwick_multirate", FUSION_MADGWICK, 4, 1},
+    {"mahony_multirate", FUSION_MAHONY, 4, 1},
+    {"madgwick_batch", FUSION_MADGWICK, 1, 4},
+};
+#define FILTER_COUNT (sizeof filters / sizeof filters[0])
+
+// Measured baseline of each filter (rows, in filters[] order) on each profile (columns, in
+// profiles[] order): convergence time (s), then steady state error rms and max (deg). A run
+// passes within a fixed margin above it, so that any regression of a filter shows up.
+// Measure it again after a deliberate change of the filters or of the sensor models.
+#define BENCH_CONVERGE_MARGIN   0.5f    // s
+#define BENCH_RMS_MARGIN        0.3f    // deg
+#define BENCH_MAX_MARGIN        0.6f    // deg
+
+typedef struct {
+    float converge;
+    float rms, max;
+} baseline_t;
+
+static const baseline_t baselines[FILTER_COUNT][PROFILE_COUNT] = {
+    {   // madgwick: static, spin, oscillation, tumble, mag_disturbance
+        {2.66f, 0.39f, 0.80f}, {2.46f, 2.87f, 3.92f}, {2.12f, 1.04f, 1.71f},
+        {9.65f, 1.48f, 3.65f}, {5.63f, 1.11f, 2.25f},
+    },
+    {   // madgwick_fixed
+        {2.65f, 0.39f, 0.79f}, {2.46f, 2.88f, 3.92f}, {2.12f, 1.05f, 1.72f},
+        {9.65f, 1.48f, 3.65f}, {5.62f, 1.10f, 2.24f},
+    },
+    {   // mahony
+        {2.01f, 0.39f, 0.57f}, {1.59f, 2.49f, 4.48f}, {2.74f, 2.04f, 3.74f},
+        {1.95f, 6.51f, 10.25f}, {4.95f, 0.41f, 0.93f},
+    },
+    {   // madgwick_multirate
+        {2.62f, 0.44f, 0.85f}, {2.42f, 2.68f, 3.75f}, {2.06f, 0.77f, 1.45f},
+        {9.60f, 1.33f, 3.39f}, {5.66f, 1.09f, 2.29f},
+    },
+    {   // mahony_multirate
+        {0.64f, 0.32f, 0.63f}, {5.16f, 2.12f, 4.02f}, {3.82f, 1.56f, 2.68f},
+        {4.12f, 3.47f, 5.88f}, {5.64f, 0.40f, 0.94f},
+    },
+    {   // madgwick_batch
+        {2.72f, 0.58f, 0.98f}, {2.52f, 1.91f, 2.99f}, {2.28f, 1.12f, 1.97f},
+        {9.48f, 1.67f, 2.95f}, {5.76f, 1.30f, 2.40f},
+    },
+};
+
+// Earth frame references: gravity along z, magnetic field with a 64 deg inclination (Paris),
+// and the disturbance: a magnet bringing half the Earth field, horizontally
+static const float gravity[3] = {0.0f, 0.0f, 1.0f};
+static const float north[3] = {0.4384f, 0.0f, 0.8988f};
+static const float magnet[3] = {0.0f, 0.5f, 0.0f};
+
+// Pseudo random noise, reproducible from one run to the other
+static uint32_t seed;
+
+// Uniform in [-1, 1]
+static float noise(void)
+{
+    seed = seed * 1664525UL + 1013904223UL;
+    return (int32_t)seed * (1.0f / 2147483648.0f);
+}
+
+// Close to a gaussian (sum of 3 uniforms), unit variance
+static float gauss(void)
+{
+    return noise() + noise() + noise();
+}
+
+// Bias of one sensor axis, fixed for a whole run, either +b or -b
+static float bias(float b)
+{
+    return noise() < 0.0f ? -b : b;
+}
+
+// Round to the sensor LSB
+static float quantise(float x)
+{
+    return floorf(x + 0.5f);
+}
+
+static void quat_mul(const float *a, const float *b, float *r)
+{
+    r[0] = a[0] * b[0] - a[1] * b[1] - a[2] * b[2] - a[3] * b[3];
+    r[1] = a[0] * b[1] + a[1] * b[0] + a[2] * b[3] - a[3] * b[2];
+    r[2] = a[0] * b[2] - a[1] * b[3] + a[2] * b[0] + a[3] * b[1];
+    r[3] = a[0] * b[3] + a[1] * b[2] - a[2] * b[1] + a[3] * b[0];
+}
+
+static void quat_normalise(float *q)
+{
+    float norm = 1.0f / sqrtf(q[0] * q[0] + q[1] * q[1] + q[2] * q[2] + q[3] * q[3]);
+    for (int i = 0; i < 4; i++)
+        q[i] *= norm;
+}
+
+// Express an Earth frame vector in the sensor frame: q' * v * q
+static void earth_to_sensor(const float *q, const float *v, float *r)
+{
+    float p[4] = {0.0f, v[0], v[1], v[2]};
+    float c[4] = {q[0], -q[1], -q[2], -q[3]};
+    float t[4], u[4];
+
+    quat_mul(c, p, t);
+    quat_mul(t, q, u);
+    r[0] = u[1];
+    r[1] = u[2];
+    r[2] = u[3];
+}
+
+// Angle (in degrees) of the rotation between two orientations, from the vector part of a' * b
+// (an acos of the dot product has no resolution below some 0.05 deg in float)
+static float quat_angle(const float *a, const float *b)
+{
+    float c[4] = {a[0], -a[1], -a[2], -a[3]};
+    float r[4];
+
+    quat_mul(c, b, r);
+    return 2.0f * atan2f(sqrtf(r[1] * r[1] + r[2] * r[2] + r[3] * r[3]), fabsf(r[0])) * 180.0f / M_PI;
+}
+
+// Run filter f on profile p, print its results and return whether it stayed within its
+// baseline b plus the margins
+static bool bench_filter(int f, const profile_t *p, const baseline_t *b)
+{
+    // Ground truth starts 60 deg away from the filter initial estimate
+    float truth[4] = {0.8660f, 0.3536f, 0.3536f, 0.0f};
+    fusion_t fusion;
+    fusion_sample_t block[BENCH_MAX_BATCH];
+    int block_len = 0;
+    float w[3], a[3], m[3], dq[4], next[4], field[3];
+    float accel_bias[3], gyro_bias[3], mag_bias[3];
+    int samples = (int)(p->duration / BENCH_DT + 0.5f);
+    uint64_t elapsed = 0;
+    uint32_t start;
+    int converged_at = -1;
+    float err, err_max = 0.0f, err_sum2 = 0.0f;
+    int err_count = 0;
+    float converge_time;
+    float converge_max = b->converge + BENCH_CONVERGE_MARGIN;
+    float rms_max = b->rms + BENCH_RMS_MARGIN;
+    float max_max = b->max + BENCH_MAX_MARGIN;
+    float converged_deg = max_max > BENCH_CONVERGED_DEG ? max_max : BENCH_CONVERGED_DEG;
+    bool pass;
+
+    fusion_init(&fusion, filters[f].algo);
+    seed = 1;
+    for (int j = 0; j < 3; j++) {
+        accel_bias[j] = bias(ACCEL_BIAS);
+        gyro_bias[j] = bias(GYRO_BIAS);
+        mag_bias[j] = bias(MAG_BIAS);
+    }
+
+    for (int i = 0; i < samples; i++) {
+        float t = i * BENCH_DT;
+
+        // Move the ground truth
+        p->rate(t, w);
+        dq[0] = 1.0f;
+        dq[1] = 0.5f * w[0] * BENCH_DT;
+        dq[2] = 0.5f * w[1] * BENCH_DT;
+        dq[3] = 0.5f * w[2] * BENCH_DT;
+        quat_mul(truth, dq, next);
+        quat_normalise(next);
+        for (int j = 0; j < 4; j++)
+            truth[j] = next[j];
+
+        // What the sensors see
+        for (int j = 0; j < 3; j++)
+            field[j] = north[j];
+        if (t >= p->disturb_from && t < p->disturb_to)
+            for (int j = 0; j < 3; j++)
+                field[j] += magnet[j];
+        earth_to_sensor(truth, gravity, a);
+        earth_to_sensor(truth, field, m);
+        for (int j = 0; j < 3; j++) {
+            a[j] = quantise((a[j] + accel_bias[j] + ACCEL_NOISE * gauss()) * ACCEL_LSB_PER_G);
+            w[j] = quantise((w[j] + gyro_bias[j] + GYRO_NOISE * gauss()) * GYRO_LSB_PER_RAD) / GYRO_LSB_PER_RAD;
+            m[j] = quantise(m[j] * MAG_FIELD + mag_bias[j] + MAG_NOISE * gauss());
+        }
+
+        start = get_time();
+        if (filters[f].batch > 1) {
+            fusion_sample_t *b = &block[block_len++];
+            b->ax = a[0]; b->ay = a[1]; b->az = a[2];
+            b->gx = w[0]; b->gy = w[1]; b->gz = w[2];
+            b->dt = BENCH_DT;
+            if (block_len == filters[f].batch) {
+                madgwick_quaternion_update_batch(&fusion, block, block_len, m[0], m[1], m[2]);
+                block_len = 0;
+            }
+        }
+        else if (filters[f].decimation == 1)
+            fusion_update(&fusion, a[0], a[1], a[2], w[0], w[1], w[2], m[0], m[1], m[2], BENCH_DT);
+        else {
+            fusion_predict(&fusion, w[0], w[1], w[2], BENCH_DT);
+            if (i % filters[f].decimation == 0)
+                fusion_correct(&fusion, a[0], a[1], a[2], m[0], m[1], m[2],
+                               filters[f].decimation * BENCH_DT);
+        }
+        elapsed += (uint32_t)(get_time() - start);
+
+        // In batch mode, the estimate is only up to date at the end of a block
+        if (block_len != 0)
+            continue;
+
+        err = quat_angle(fusion.q, truth);
+        if (err > converged_deg)
+            converged_at = -1;
+        else if (converged_at < 0)
+            converged_at = i;
+
+        // Steady state error
+        if (t >= p->settle_from) {
+            if (err > err_max)
+                err_max = err;
+            err_sum2 += err * err;
+            err_count++;
+        }
+    }
+
+    err_sum2 = sqrtf(err_sum2 / err_count);
+    // After a disturbance, what matters is the recovery time
+    converge_time = converged_at * BENCH_DT - p->disturb_to;
+    pass = converged_at >= 0 && converge_time <= converge_max
+           && err_sum2 <= rms_max && err_max <= max_max;
+
+    printf("  %s: %d ns/update, ", filters[f].name, (int)(elapsed * BENCH_TICK_NS / samples));
+    if (converged_at < 0)
+        printf("not converged, ");
+    else
+        printf("converged in %d ms (< %d), ", (int)(converge_time * 1000.0f),
+               (int)(converge_max * 1000.0f));
+    printf("error rms %f deg (< %f), max %f deg (< %f): %s\r\n",
+           err_sum2, rms_max, err_max, max_max, pass ? "ok" : "FAIL");
+
+    return pass;
+}
+
+// Largest relative error e of inv_sqrt() against libm, over the range seen by the filters,
+// and the orientation error it may bring (see fast_math.h). Returns whether it is in spec.
+static bool bench_inv_sqrt(void)
+{
+    float err, err_max = 0.0f;
+
+    for (float x = 1e-6f; x < 1e6f; x *= 1.01f) {
+        err = fabsf(inv_sqrt(x) * sqrtf(x) - 1.0f);
+        if (err > err_max)
+            err_max = err;
+    }
+    printf("inv_sqrt: max relative error %f ppm, orientation error < %f deg: %s\r\n",
+           err_max * 1e6f, sqrtf(2.0f * err_max) * 180.0f / M_PI,
+           err_max <= INV_SQRT_MAX_ERROR ? "ok" : "FAIL");
+
+    return err_max <= INV_SQRT_MAX_ERROR;
+}
+
+// Fixed-point Madgwick against the float one, on the same inputs: single updates from random
+// orientations and samples (largest difference on a quaternion component), then both
+// filters free running on the tumble profile (largest angle between both estimates, and
+// largest deviation of the fixed-point |q| from 1). Returns whether all stay within the
+// thresholds, about 3 times the measured values.
+#define FIXED_STEPS         10000
+#define FIXED_STEP_MAX      2e-5f   // on a quaternion component
+#define FIXED_RUN_MAX       0.1f    // deg
+#define FIXED_NORM_MAX      3e-7f
+
+static bool bench_fixed(void)
+{
+    float truth[4] = {1.0f, 0.0f, 0.0f, 0.0f};
+    fusion_t ref, fixed;
+    float w[3], a[3], m[3], dq[4], next[4];
+    float d, step_max = 0.0f, run_max = 0.0f, norm_max = 0.0f;
+    int samples = (int)(20.0f / BENCH_DT + 0.5f);
+    bool pass;
+
+    fusion_init(&ref, FUSION_MADGWICK);
+    fusion_init(&fixed, FUSION_MADGWICK_FIXED);
+    seed = 1;
+
+    for (int i = 0; i < FIXED_STEPS; i++) {
+        for (int j = 0; j < 4; j++)
+            ref.q[j] = noise();
+        quat_normalise(ref.q);
+        for (int j = 0; j < 4; j++)
+            fixed.q[j] = ref.q[j];
+        for (int j = 0; j < 3; j++) {
+            a[j] = noise() * ACCEL_LSB_PER_G;
+            w[j] = noise() * 5.0f;
+            m[j] = noise() * MAG_FIELD;
+        }
+        fusion_update(&ref, a[0], a[1], a[2], w[0], w[1], w[2], m[0], m[1], m[2], BENCH_DT);
+        fusion_update(&fixed, a[0], a[1], a[2], w[0], w[1], w[2], m[0], m[1], m[2], BENCH_DT);
+        for (int j = 0; j < 4; j++) {
+            d = fabsf(fixed.q[j] - ref.q[j]);
+            if (d > step_max)
+                step_max = d;
+        }
+    }
+
+    fusion_reset(&ref);
+    fusion_reset(&fixed);
+    for (int i = 0; i < samples; i++) {
+        rate_tumble(i * BENCH_DT, w);
+        dq[0] = 1.0f;
+        dq[1] = 0.5f * w[0] * BENCH_DT;
+        dq[2] = 0.5f * w[1] * BENCH_DT;
+        dq[3] = 0.5f * w[2] * BENCH_DT;
+        quat_mul(truth, dq, next);
+        quat_normalise(next);
+        for (int j = 0; j < 4; j++)
+            truth[j] = next[j];
+
+        earth_to_sensor(truth, gravity, a);
+        earth_to_sensor(truth, north, m);
+        for (int j = 0; j < 3; j++) {
+            a[j] = quantise((a[j] + ACCEL_NOISE * gauss()) * ACCEL_LSB_PER_G);
+            w[j] = quantise((w[j] + GYRO_NOISE * gauss()) * GYRO_LSB_PER_RAD) / GYRO_LSB_PER_RAD;
+            m[j] = quantise(m[j] * MAG_FIELD + MAG_NOISE * gauss());
+        }
+        fusion_update(&ref, a[0], a[1], a[2], w[0], w[1], w[2], m[0], m[1], m[2], BENCH_DT);
+        fusion_update(&fixed, a[0], a[1], a[2], w[0], w[1], w[2], m[0], m[1], m[2], BENCH_DT);
+        d = quat_angle(fixed.q, ref.q);
+        if (d > run_max)
+            run_max = d;
+        d = fabsf(sqrtf(fixed.q[0] * fixed.q[0] + fixed.q[1] * fixed.q[1]
+                        + fixed.q[2] * fixed.q[2] + fixed.q[3] * fixed.q[3]) - 1.0f);
+        if (d > norm_max)
+            norm_max = d;
+    }
+
+    pass = step_max <= FIXED_STEP_MAX && run_max <= FIXED_RUN_MAX && norm_max <= FIXED_NORM_MAX;
+    printf("madgwick_fixed against madgwick: single update max %f ppm, free running max %f deg, "
+           "|q| - 1 max %f ppm: %s\r\n",
+           step_max * 1e6f, run_max, norm_max * 1e6f, pass ? "ok" : "FAIL");
+    return pass;
+}
+
+int fusion_bench_run(void)
+{
+    int failures = 0;
+
+    if (!bench_inv_sqrt())
+        failures++;
+    if (!bench_fixed())
+        failures++;
+    for (int p = 0; p < PROFILE_COUNT; p++) {
+        printf("Fusion bench, %s: %d s at %d Hz\r\n",
+               profiles[p].name, (int)profiles[p].duration, (int)(1.0f / BENCH_DT + 0.5f));
+        for (int f = 0; f < FILTER_COUNT; f++)
+            if (!bench_filter(f, &profiles[p], &baselines[f][p]))
+                failures++;
+    }
+    printf("Fusion bench: %d failure(s)\r\n", failures);
+    return failures;
+}
@@ -0,0 +1,11 @@
+#ifndef FUSION_BENCH_H
+#define FUSION_BENCH_H
+
+// Replay synthetic 9 axis streams (several motion profiles, with modelled sensor noise, bias
+// and quantisation) through every fusion filter and print, for each of them, the time spent
+// per update, the convergence time and the angular error against the ground truth.
+// The inv_sqrt() accuracy and the fixed-point Madgwick against the float one are checked first.
+// Returns the number of runs that missed the convergence or accuracy thresholds.
+int fusion_bench_run(void);
+
+#endif
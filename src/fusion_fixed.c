@@ -0,0 +1,244 @@
+#include "fusion.h"
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+// Fixed-point version of madgwick_quaternion_update(), for the FPU-less Cortex-M0.
+//
+// The math is the same as the float reference in fusion.c, only the number formats change:
+//   - the normalised vectors (accel, mag, reference field) and the gradient terms are Q13
+//     (every factor stays below 4, so a 32 bit product of two of them cannot overflow),
+//   - the quaternion and the per sample increments (gyro * dt / 2, beta * dt) are Q30, so the
+//     small gyro increments are not lost. Q30 products go through a 64 bit multiply.
+// Square roots are integer (bit by bit) ones, and each normalisation costs a single division.
+//
+// What it saves: the gradient step (about a hundred multiplies and adds, the square roots and
+// the divisions of the normalisations) runs in integer instead of soft-float. The interface
+// stays float, so each call still does about 17 soft-float operations at both ends: the
+// accel / mag normalisation scales, the quaternion to and from Q30, and the gyro and gain
+// increments. On a host with an FPU this is slower than the float version, only the M0 gains.
+//
+// The accuracy against the float reference is checked by bench_fixed() in fusion_bench.c.
+
+#define Q13_ONE (1L << 13)
+#define Q30_ONE (1L << 30)
+
+// Largest increment (gyro * dt / 2 or beta * dt) accepted in one update, in Q30. At 200 Hz
+// this is more than 2800 deg/s, so only the very first update (dt since boot) gets clamped.
+#define STEP_MAX (Q30_ONE / 8)
+
+static inline int32_t mul13(int32_t a, int32_t b)
+{
+    return (a * b + (1L << 12)) >> 13;
+}
+
+static inline int32_t mul30(int32_t a, int32_t b)
+{
+    return (int32_t)(((int64_t)a * b) >> 30);
+}
+
+static int32_t to_q30_step(float x)
+{
+    if (x > 0.125f)
+        return STEP_MAX;
+    if (x < -0.125f)
+        return -STEP_MAX;
+    return (int32_t)(x * (float)Q30_ONE);
+}
+
+// Integer square root, bit by bit (no multiply)
+static uint32_t isqrt(uint32_t x)
+{
+    uint32_t res = 0;
+    uint32_t bit = 1UL << 30;
+
+    while (bit > x)
+        bit >>= 2;
+
+    while (bit) {
+        if (x >= res + bit) {
+            x -= res + bit;
+            res = (res >> 1) + bit;
+        }
+        else
+            res >>= 1;
+        bit >>= 2;
+    }
+    return res;
+}
+
+// Scale v[0..n-1] to a unit vector in Q13. Returns false for a null vector.
+static bool normalise(int32_t *v, int n)
+{
+    uint32_t max = 0;
+    uint32_t sum = 0;
+    uint32_t r;
+    int i;
+
+    for (i = 0; i < n; i++)
+        max |= (uint32_t)(v[i] < 0 ? -v[i] : v[i]);
+    if (max == 0)
+        return false;
+
+    // Bring the largest component in [2^13, 2^14[, so that the sum of the squares fits 32 bits
+    for (; max >= (1UL << 14); max >>= 1)
+        for (i = 0; i < n; i++)
+            v[i] >>= 1;
+    for (; max < (1UL << 13); max <<= 1)
+        for (i = 0; i < n; i++)
+            v[i] <<= 1;
+
+    for (i = 0; i < n; i++)
+        sum += (uint32_t)(v[i] * v[i]);
+
+    // |v[i]| <= norm, so v[i] * r <= 2^30
+    r = (1UL << 30) / isqrt(sum);
+    for (i = 0; i < n; i++)
+        v[i] = (v[i] * (int32_t)r) >> 17;
+
+    return true;
+}
+
+// Convert a float vector of any magnitude to integers whose largest component is
+// in [2^13, 2^14[, by playing with the float exponent only, then normalise it.
+static bool normalise_float(float x, float y, float z, int32_t *v)
+{
+    union { float f; uint32_t u; } bits;
+    uint32_t e, max = 0;
+
+    bits.f = x; e = (bits.u >> 23) & 0xFF; if (e > max) max = e;
+    bits.f = y; e = (bits.u >> 23) & 0xFF; if (e > max) max = e;
+    bits.f = z; e = (bits.u >> 23) & 0xFF; if (e > max) max = e;
+    if (max == 0)
+        return false; // handle NaN
+
+    // |val| < 2^(max-126), scale by 2^(140-max)
+    e = 140 + 127 - max;
+    if (e < 1)
+        e = 1;
+    if (e > 254)
+        e = 254;
+    bits.u = e << 23;
+
+    v[0] = (int32_t)(x * bits.f);
+    v[1] = (int32_t)(y * bits.f);
+    v[2] = (int32_t)(z * bits.f);
+
+    return normalise(v, 3);
+}
+
+// Common body of the 9 and 6 DOF versions. Without magnetometer, the reference field and the
+// measured one are zeroed, which cancels every magnetic term of the gradient.
+static void update_fixed(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, bool use_mag, float dt)
+{
+    float *q = f->q;
+    int32_t a[3], m[3], s[4];
+    int32_t q1, q2, q3, q4;          // Q30
+    int32_t hgx, hgy, hgz, bdt;      // Q30
+    int32_t w1, w2, w3, w4;          // Q13 copy of the quaternion
+    int32_t hx, hy, _2bx, _2bz;
+    int32_t fg1, fg2, fg3, fb1, fb2, fb3;
+    int32_t n2, r, d;
+
+    // Normalise accelerometer and magnetometer measurements
+    if (!normalise_float(ax, ay, az, a))
+        return;
+    if (!use_mag)
+        m[0] = m[1] = m[2] = 0;
+    else if (!normalise_float(mx, my, mz, m))
+        return;
+
+    q1 = (int32_t)(q[0] * (float)Q30_ONE);
+    q2 = (int32_t)(q[1] * (float)Q30_ONE);
+    q3 = (int32_t)(q[2] * (float)Q30_ONE);
+    q4 = (int32_t)(q[3] * (float)Q30_ONE);
+    w1 = q1 >> 17;
+    w2 = q2 >> 17;
+    w3 = q3 >> 17;
+    w4 = q4 >> 17;
+
+    // Auxiliary variables to avoid repeated arithmetic
+    int32_t q1q1 = mul13(w1, w1);
+    int32_t q1q2 = mul13(w1, w2);
+    int32_t q1q3 = mul13(w1, w3);
+    int32_t q1q4 = mul13(w1, w4);
+    int32_t q2q2 = mul13(w2, w2);
+    int32_t q2q3 = mul13(w2, w3);
+    int32_t q2q4 = mul13(w2, w4);
+    int32_t q3q3 = mul13(w3, w3);
+    int32_t q3q4 = mul13(w3, w4);
+    int32_t q4q4 = mul13(w4, w4);
+
+    // Reference direction of Earth's magnetic field (q * m * q')
+    hx = mul13(m[0], q1q1 + q2q2 - q3q3 - q4q4) + mul13(m[1], 2 * (q2q3 - q1q4)) + mul13(m[2], 2 * (q2q4 + q1q3));
+    hy = mul13(m[0], 2 * (q1q4 + q2q3)) + mul13(m[1], q1q1 - q2q2 + q3q3 - q4q4) + mul13(m[2], 2 * (q3q4 - q1q2));
+    _2bx = (int32_t)isqrt((uint32_t)(hx * hx + hy * hy));
+    _2bz = mul13(m[0], 2 * (q2q4 - q1q3)) + mul13(m[1], 2 * (q1q2 + q3q4)) + mul13(m[2], q1q1 - q2q2 - q3q3 + q4q4);
+
+    // Objective function, gravity then magnetic field
+    fg1 = 2 * (q2q4 - q1q3) - a[0];
+    fg2 = 2 * (q1q2 + q3q4) - a[1];
+    fg3 = Q13_ONE - 2 * q2q2 - 2 * q3q3 - a[2];
+    fb1 = mul13(_2bx, Q13_ONE / 2 - q3q3 - q4q4) + mul13(_2bz, q2q4 - q1q3) - m[0];
+    fb2 = mul13(_2bx, q2q3 - q1q4) + mul13(_2bz, q1q2 + q3q4) - m[1];
+    fb3 = mul13(_2bx, q1q3 + q2q4) + mul13(_2bz, Q13_ONE / 2 - q2q2 - q3q3) - m[2];
+
+    // Gradient decent algorithm corrective step
+    s[0] = - mul13(2 * w3, fg1) + mul13(2 * w2, fg2)
+           - mul13(mul13(_2bz, w3), fb1)
+           + mul13(mul13(_2bz, w2) - mul13(_2bx, w4), fb2)
+           + mul13(mul13(_2bx, w3), fb3);
+    s[1] = mul13(2 * w4, fg1) + mul13(2 * w1, fg2) - mul13(4 * w2, fg3)
+           + mul13(mul13(_2bz, w4), fb1)
+           + mul13(mul13(_2bx, w3) + mul13(_2bz, w1), fb2)
+           + mul13(mul13(_2bx, w4) - mul13(2 * _2bz, w2), fb3);
+    s[2] = - mul13(2 * w1, fg1) + mul13(2 * w4, fg2) - mul13(4 * w3, fg3)
+           - mul13(mul13(2 * _2bx, w3) + mul13(_2bz, w1), fb1)
+           + mul13(mul13(_2bx, w2) + mul13(_2bz, w4), fb2)
+           + mul13(mul13(_2bx, w1) - mul13(2 * _2bz, w3), fb3);
+    s[3] = mul13(2 * w2, fg1) + mul13(2 * w3, fg2)
+           + mul13(mul13(_2bz, w2) - mul13(2 * _2bx, w4), fb1)
+           + mul13(mul13(_2bz, w3) - mul13(_2bx, w1), fb2)
+           + mul13(mul13(_2bx, w2), fb3);
+    if (!normalise(s, 4))
+        s[0] = s[1] = s[2] = s[3] = 0;   // already at the minimum
+
+    // Rate of change of quaternion, integrated over dt
+    dt *= 0.5f;
+    hgx = to_q30_step(gx * dt);
+    hgy = to_q30_step(gy * dt);
+    hgz = to_q30_step(gz * dt);
+    bdt = to_q30_step(f->beta * 2.0f * dt);
+
+    w1 = q1 - mul30(q2, hgx) - mul30(q3, hgy) - mul30(q4, hgz) - (int32_t)(((int64_t)bdt * s[0]) >> 13);
+    w2 = q2 + mul30(q1, hgx) + mul30(q3, hgz) - mul30(q4, hgy) - (int32_t)(((int64_t)bdt * s[1]) >> 13);
+    w3 = q3 + mul30(q1, hgy) - mul30(q2, hgz) + mul30(q4, hgx) - (int32_t)(((int64_t)bdt * s[2]) >> 13);
+    w4 = q4 + mul30(q1, hgz) + mul30(q2, hgy) - mul30(q3, hgx) - (int32_t)(((int64_t)bdt * s[3]) >> 13);
+
+    // Normalise quaternion: 1/sqrt(n2) by Newton iterations, starting from the first order
+    // approximation. |q| stays within [0.66, 1.34] thanks to STEP_MAX, so everything fits Q30.
+    n2 = (int32_t)(((int64_t)w1 * w1 + (int64_t)w2 * w2 + (int64_t)w3 * w3 + (int64_t)w4 * w4) >> 30);
+    r = Q30_ONE + (Q30_ONE - n2) / 2;
+    for (int i = 0; i < 8; i++) {
+        d = mul30(r, Q30_ONE - mul30(n2, mul30(r, r))) / 2;
+        r += d;
+        if (d < 2 && d > -2)
+            break;
+    }
+
+    q[0] = mul30(w1, r) * (1.0f / Q30_ONE);
+    q[1] = mul30(w2, r) * (1.0f / Q30_ONE);
+    q[2] = mul30(w3, r) * (1.0f / Q30_ONE);
+    q[3] = mul30(w4, r) * (1.0f / Q30_ONE);
+}
+
+void madgwick_quaternion_update_fixed(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float mx, float my, float mz, float dt)
+{
+    update_fixed(f, ax, ay, az, gx, gy, gz, mx, my, mz, true, dt);
+}
+
+void madgwick_imu_update_fixed(fusion_t *f, float ax, float ay, float az, float gx, float gy, float gz, float dt)
+{
+    update_fixed(f, ax, ay, az, gx, gy, gz, 0.0f, 0.0f, 0.0f, false, dt);
+}
@@ -24,7 +24,8 @@ void high_res_timer_init()
     // Ensure 16 bit mode on both timers
     NRF_TIMER1->BITMODE        = 0;
     NRF_TIMER2->BITMODE        = 0;
-    // On timer1 overflow, increment timer2 using PPI
+    // On timer1 overflow, increment timer2 using PPI (CC[1] is for get_time(), CC[2] and
+    // CC[3] for the TWI resume of i2c_async.c)
     NRF_TIMER1->CC[0] = 0;
     sd_ppi_channel_assign(1, &NRF_TIMER1->EVENTS_COMPARE[0], &NRF_TIMER2->TASKS_COUNT);
     sd_ppi_channel_enable_set(PPI_CHEN_CH1_Msk);
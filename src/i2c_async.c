@@ -0,0 +1,402 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "i2c_async.h"
+#include "twi_master.h"
+#include "high_res_timer.h"
+#include "nrf.h"
+#include "nrf_soc.h"
+#include "nrf_delay.h"
+#include "nrf_gpio.h"
+#include "app_util.h"
+
+// The queue: head is the running transaction
+static i2c_transaction_t *head = NULL;
+static i2c_transaction_t *tail = NULL;
+
+// Progress of the running transaction
+static enum { PHASE_REG, PHASE_WRITE, PHASE_READ } phase;
+static uint8_t count;
+
+static i2c_async_stats_t stats;
+
+// Time limit of a running transaction, for the ones nobody waits for (see
+// i2c_async_check_timeout()). A transaction lasts 23 ms at most, 255 bytes at 100 kHz.
+#define TRANSACTION_TIMEOUT 50000   // us
+static uint32_t watched;            // stats.transactions when the running one was first seen
+static uint32_t watched_at;
+
+// Bus clock, applied at the start of each transaction
+static uint16_t frequency_khz = 100;
+static uint32_t frequency = TWI_FREQUENCY_FREQUENCY_K100;
+
+// PAN 56 ("TWI: TWI module lock-up.") asks for a delay between the suspend of the bus (after
+// each received byte) and its resume. Instead of waiting for it in the interrupt, the resume
+// is triggered by a compare of the free running 1 MHz TIMER1 of high_res_timer.c (CC[0] and
+// CC[1] are used there), through PPI.
+#define RESUME_DELAY    20      // us, as the blocking driver
+#define RESUME_CC       2
+#define NOW_CC          3       // short delays, from the TWI interrupt or a critical region
+#define RESUME_PPI      2       // channel 0 is the BB event, channel 1 the high res timer
+
+// Hardware triggered transaction (see i2c_async_set_trigger()): while the queue is empty, the
+// TWI is loaded with it, and the rising edge of the pin starts it through GPIOTE and PPI
+#define TRIGGER_GPIOTE  0
+#define TRIGGER_PPI     3
+// More than the address and register bytes at 100 kHz: the TXDSENT event of a started
+// transaction comes before
+#define TRIGGER_START_TIME 300  // us
+
+static i2c_transaction_t *trigger = NULL;
+static uint8_t trigger_pin;
+static volatile bool armed = false;     // loaded in the TWI, waiting for the edge
+
+#define TWI_INTERRUPTS  (TWI_INTENSET_STOPPED_Msk | TWI_INTENSET_RXDREADY_Msk | \
+                         TWI_INTENSET_TXDSENT_Msk | TWI_INTENSET_ERROR_Msk)
+
+void i2c_async_init(void)
+{
+    APP_ERROR_CHECK(sd_ppi_channel_assign(RESUME_PPI, &NRF_TIMER1->EVENTS_COMPARE[RESUME_CC],
+                                          &NRF_TWI1->TASKS_RESUME));
+    NRF_TWI1->INTENCLR = TWI_INTERRUPTS;
+    APP_ERROR_CHECK(sd_nvic_ClearPendingIRQ(SPI1_TWI1_IRQn));
+    APP_ERROR_CHECK(sd_nvic_SetPriority(SPI1_TWI1_IRQn, APP_IRQ_PRIORITY_LOW));
+    APP_ERROR_CHECK(sd_nvic_EnableIRQ(SPI1_TWI1_IRQn));
+}
+
+static uint16_t now(void)
+{
+    NRF_TIMER1->TASKS_CAPTURE[NOW_CC] = 1;
+    return NRF_TIMER1->CC[NOW_CC];
+}
+
+// Load the TWI with the transaction, up to the register address
+static void load(i2c_transaction_t *t)
+{
+    phase = PHASE_REG;
+    count = 0;
+
+    NRF_TWI1->EVENTS_TXDSENT  = 0;
+    NRF_TWI1->EVENTS_RXDREADY = 0;
+    NRF_TWI1->EVENTS_STOPPED  = 0;
+    NRF_TWI1->EVENTS_ERROR    = 0;
+    NRF_TWI1->FREQUENCY       = frequency << TWI_FREQUENCY_FREQUENCY_Pos;
+    NRF_TWI1->ADDRESS         = t->address;
+    NRF_TWI1->INTENSET        = TWI_INTERRUPTS;
+    NRF_TWI1->TXD             = t->reg;
+}
+
+// Send the register address. Only touches the TWI registers, so that a submit from an
+// APP_IRQ_PRIORITY_HIGH interrupt can start the bus (no SoftDevice call there).
+static void start(i2c_transaction_t *t)
+{
+    load(t);
+    NRF_TWI1->TASKS_STARTTX = 1;
+}
+
+// The trigger pin rose while the PPI channel was switched, before or after: if the TWI does
+// not show that it started, start it
+static void trigger_settle(void)
+{
+    uint16_t from = now();
+
+    while (!NRF_TWI1->EVENTS_TXDSENT && !NRF_TWI1->EVENTS_ERROR)
+        if ((uint16_t)(now() - from) >= TRIGGER_START_TIME) {
+            NRF_TWI1->TASKS_STARTTX = 1;
+            return;
+        }
+}
+
+// The queue is empty: queue the trigger transaction, for the pin to start it. Not after a
+// failure, its owner submits it again. Critical region.
+static void arm(void)
+{
+    if (trigger == NULL || trigger->status != I2C_DONE)
+        return;
+
+    trigger->status = I2C_QUEUED;
+    trigger->next = NULL;
+    head = tail = trigger;
+
+    // The pin stays high until the data is read: if it is already, the edge is gone
+    if (nrf_gpio_pin_read(trigger_pin)) {
+        start(trigger);
+        return;
+    }
+    load(trigger);
+    armed = true;
+    sd_ppi_channel_enable_set(1UL << TRIGGER_PPI);
+    if (nrf_gpio_pin_read(trigger_pin))
+        trigger_settle();
+}
+
+// Another transaction is submitted while the trigger one is armed. Not started: it leaves the
+// queue until it is empty again. Started, or starting: it runs first. Critical region, not at
+// APP_IRQ_PRIORITY_HIGH (SoftDevice call).
+static void disarm(void)
+{
+    sd_ppi_channel_enable_clr(1UL << TRIGGER_PPI);
+    armed = false;
+
+    if (nrf_gpio_pin_read(trigger_pin)) {
+        trigger_settle();
+        return;
+    }
+    NRF_TWI1->INTENCLR = TWI_INTERRUPTS;
+    head = trigger->next;
+    if (head == NULL)
+        tail = NULL;
+    else
+        start(head);
+    trigger->status = I2C_DONE;
+}
+
+// End the running transaction and start the next one. TWI interrupt, or critical region.
+// A submit from APP_IRQ_PRIORITY_HIGH may preempt the TWI interrupt, and it appends to tail
+// while head is set: the queue links are updated in a critical region, which masks it.
+static void complete(bool success)
+{
+    i2c_transaction_t *t = head;
+
+    NRF_TWI1->INTENCLR = TWI_INTERRUPTS;
+    sd_ppi_channel_enable_clr(PPI_CHENCLR_CH0_Msk | (1UL << RESUME_PPI) | (1UL << TRIGGER_PPI));
+    armed = false;
+
+    CRITICAL_REGION_ENTER();
+    head = t->next;
+    if (head == NULL)
+        tail = NULL;
+    else
+        start(head);
+    CRITICAL_REGION_EXIT();
+
+    stats.transactions++;
+    t->status = success ? I2C_DONE : I2C_FAILED;
+    if (t->callback)
+        t->callback(t, success);
+
+    // After the callback, which may set the next buffer of the trigger transaction
+    CRITICAL_REGION_ENTER();
+    if (head == NULL)
+        arm();
+    CRITICAL_REGION_EXIT();
+}
+
+// Recover the peripheral as indicated by PAN 56: "TWI: TWI module lock-up.", as the blocking
+// driver does, then let the bus be cleared by twi_master_init()
+static void recover(void)
+{
+    stats.recoveries++;
+    NRF_TWI1->EVENTS_ERROR = 0;
+    NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Disabled << TWI_ENABLE_ENABLE_Pos;
+    NRF_TWI1->POWER        = 0;
+    nrf_delay_us(5);
+    NRF_TWI1->POWER        = 1;
+    NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Enabled << TWI_ENABLE_ENABLE_Pos;
+
+    if (!twi_master_init())
+        stats.bus_stuck++;
+}
+
+// Resume the bus RESUME_DELAY after now. The PPI channel is enabled at the first byte of a
+// read, once the compare is set (an old one could match while the bus is suspended). Should
+// the interrupt be late enough for the compare to be missed, the delay is over anyway: resume
+// right away.
+static void resume_arm(bool enable)
+{
+    uint16_t from = now();
+
+    NRF_TIMER1->CC[RESUME_CC] = (uint16_t)(from + RESUME_DELAY);
+    if (enable)
+        sd_ppi_channel_enable_set(1UL << RESUME_PPI);
+
+    if ((uint16_t)(now() - from) >= RESUME_DELAY)
+        NRF_TWI1->TASKS_RESUME = 1;
+}
+
+void SPI1_TWI1_IRQHandler(void)
+{
+    i2c_transaction_t *t = head;
+
+    if (t == NULL)
+        return;
+
+    if (armed) {
+        // Started by the trigger pin: the next edge must not start it again
+        armed = false;
+        sd_ppi_channel_enable_clr(1UL << TRIGGER_PPI);
+    }
+
+    if (NRF_TWI1->EVENTS_ERROR) {
+        // NACK or overrun: nothing more will come for this transaction
+        stats.errors++;
+        NRF_TWI1->INTENCLR = TWI_INTERRUPTS;
+        recover();
+        complete(false);
+        return;
+    }
+
+    if (NRF_TWI1->EVENTS_TXDSENT) {
+        NRF_TWI1->EVENTS_TXDSENT = 0;
+        if (phase == PHASE_REG && t->read) {
+            // Repeated start, each byte suspends the bus (BB event) until RXD is read, the last
+            // one stops it
+            phase = PHASE_READ;
+            sd_ppi_channel_assign(0, &NRF_TWI1->EVENTS_BB,
+                                  t->length == 1 ? &NRF_TWI1->TASKS_STOP : &NRF_TWI1->TASKS_SUSPEND);
+            sd_ppi_channel_enable_set(PPI_CHENSET_CH0_Msk);
+            NRF_TWI1->TASKS_STARTRX = 1;
+        }
+        else {
+            phase = PHASE_WRITE;
+            if (count < t->length)
+                NRF_TWI1->TXD = t->data[count++];
+            else
+                NRF_TWI1->TASKS_STOP = 1;
+        }
+    }
+
+    if (NRF_TWI1->EVENTS_RXDREADY) {
+        NRF_TWI1->EVENTS_RXDREADY = 0;
+        t->data[count++] = NRF_TWI1->RXD;
+
+        // Stop the bus before the last BB event
+        if (t->length - count == 1)
+            sd_ppi_channel_assign(0, &NRF_TWI1->EVENTS_BB, &NRF_TWI1->TASKS_STOP);
+        if (count < t->length)
+            resume_arm(count == 1);
+    }
+
+    if (NRF_TWI1->EVENTS_STOPPED) {
+        NRF_TWI1->EVENTS_STOPPED = 0;
+        complete(true);
+    }
+}
+
+bool i2c_async_submit(i2c_transaction_t *t)
+{
+    bool queued = false;
+
+    CRITICAL_REGION_ENTER();
+    if (t->status != I2C_QUEUED && (!t->read || t->length > 0)) {
+        // From APP_IRQ_PRIORITY_HIGH, it waits for the trigger transaction instead
+        if (armed && current_int_priority_get() != APP_IRQ_PRIORITY_HIGH)
+            disarm();
+        t->status = I2C_QUEUED;
+        t->next = NULL;
+        if (tail == NULL) {
+            head = tail = t;
+            start(t);
+        }
+        else {
+            tail->next = t;
+            tail = t;
+        }
+        queued = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return queued;
+}
+
+void i2c_async_check_timeout(void)
+{
+    uint32_t time = get_time();
+
+    CRITICAL_REGION_ENTER();
+    // Nothing running, or a transaction ended since the last check: start over. An armed
+    // trigger transaction waits for its pin, not for the bus.
+    if (head == NULL || armed || stats.transactions != watched) {
+        watched = stats.transactions;
+        watched_at = time;
+    }
+    else if (time - watched_at >= TRANSACTION_TIMEOUT) {
+        // Stuck, as in i2c_async_wait()
+        stats.lockups++;
+        recover();
+        complete(false);
+    }
+    CRITICAL_REGION_EXIT();
+}
+
+bool i2c_async_wait(i2c_transaction_t *t, uint32_t timeout_us)
+{
+    uint32_t start_time = get_time();
+    uint32_t waited_from = start_time;
+
+    while (t->status == I2C_QUEUED) {
+        if (get_time() - start_time < timeout_us)
+            continue;
+
+        // Stuck: clear the bus, then fail the running transaction (which may be another one,
+        // this one is behind it in the queue) and go on with the next ones
+        CRITICAL_REGION_ENTER();
+        if (t->status == I2C_QUEUED) {
+            stats.lockups++;
+            recover();
+            complete(false);
+        }
+        CRITICAL_REGION_EXIT();
+        start_time = get_time();
+    }
+
+    uint32_t latency = get_time() - waited_from;
+    if (latency > stats.worst_latency)
+        stats.worst_latency = latency;
+    return t->status == I2C_DONE;
+}
+
+void i2c_async_get_stats(i2c_async_stats_t *s)
+{
+    CRITICAL_REGION_ENTER();
+    *s = stats;
+    s->bus_clears = twi_master_clear_bus_count;
+    CRITICAL_REGION_EXIT();
+}
+
+bool i2c_async_set_frequency(uint16_t khz)
+{
+    switch (khz) {
+    case 100:
+        frequency = TWI_FREQUENCY_FREQUENCY_K100;
+        break;
+    case 250:
+        frequency = TWI_FREQUENCY_FREQUENCY_K250;
+        break;
+    case 400:
+        frequency = TWI_FREQUENCY_FREQUENCY_K400;
+        break;
+    default:
+        return false;
+    }
+    frequency_khz = khz;
+    return true;
+}
+
+uint16_t i2c_async_get_frequency(void)
+{
+    return frequency_khz;
+}
+
+bool i2c_async_set_trigger(i2c_transaction_t *t, uint8_t pin)
+{
+    bool set = false;
+
+    CRITICAL_REGION_ENTER();
+    if (trigger == NULL && t->status != I2C_QUEUED && t->read && t->length > 0) {
+        trigger = t;
+        trigger_pin = pin;
+        NRF_GPIOTE->CONFIG[TRIGGER_GPIOTE] = (GPIOTE_CONFIG_MODE_Event << GPIOTE_CONFIG_MODE_Pos)
+                                           | (pin << GPIOTE_CONFIG_PSEL_Pos)
+                                           | (GPIOTE_CONFIG_POLARITY_LoToHi << GPIOTE_CONFIG_POLARITY_Pos);
+        APP_ERROR_CHECK(sd_ppi_channel_assign(TRIGGER_PPI, &NRF_GPIOTE->EVENTS_IN[TRIGGER_GPIOTE],
+                                              &NRF_TWI1->TASKS_STARTTX));
+        if (head == NULL)
+            arm();
+        set = true;
+    }
+    CRITICAL_REGION_EXIT();
+
+    return set;
+}
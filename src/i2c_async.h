@@ -0,0 +1,69 @@
+#ifndef I2C_ASYNC_H
+#define I2C_ASYNC_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Interrupt driven TWI1 master: transactions are queued and run one after the other by the
+// TWI interrupt (APP_IRQ_PRIORITY_LOW), the CPU is free meanwhile. The descriptors belong to
+// the callers, they must stay untouched while queued. The synchronous i2c_wrapper.h
+// functions run on top of this queue.
+
+typedef struct i2c_transaction_s i2c_transaction_t;
+
+// Called from the TWI interrupt when the transaction is over. It may submit the same
+// transaction, or another one, again.
+typedef void (*i2c_callback_t)(i2c_transaction_t *t, bool success);
+
+// Transaction status
+#define I2C_DONE    0
+#define I2C_QUEUED  1
+#define I2C_FAILED  2
+
+// Register access: reg is sent first, then length bytes are either written, or read after a
+// repeated start
+struct i2c_transaction_s {
+    uint8_t address;            // 7 bit
+    uint8_t reg;
+    bool read;
+    uint8_t length;             // 0 only for a write
+    uint8_t *data;
+    i2c_callback_t callback;    // may be NULL
+    void *context;              // for the caller
+    volatile uint8_t status;
+    i2c_transaction_t *next;    // queue link
+};
+
+// Bus health, since the start
+typedef struct {
+    uint32_t transactions;      // completed, successfully or not
+    uint32_t errors;            // NACK or overrun reported by the TWI
+    uint32_t lockups;           // no end of transaction in time
+    uint32_t recoveries;        // TWI power cycles, after an error or a lock-up
+    uint32_t bus_clears;        // bus clear sequences (SCL pulses until SDA is released)
+    uint32_t bus_stuck;         // bus clears that failed, SDA still held low
+    uint32_t worst_latency;     // us, from i2c_async_wait() to the end of the transaction
+} i2c_async_stats_t;
+
+void i2c_async_init(void);
+// Queue a transaction. Returns false if it is already queued. Any interrupt priority.
+bool i2c_async_submit(i2c_transaction_t *t);
+// Wait for the end of a queued transaction, up to timeout_us (then it is aborted). Not from
+// an interrupt. Returns true on success.
+bool i2c_async_wait(i2c_transaction_t *t, uint32_t timeout_us);
+// Abort the running transaction if it has not ended after a while, as i2c_async_wait() does,
+// for the transactions nobody waits for. To be called periodically, not from an interrupt.
+void i2c_async_check_timeout(void);
+void i2c_async_get_stats(i2c_async_stats_t *stats);
+// Let the rising edge of pin start the read t, through GPIOTE and PPI, without the CPU. The
+// pin must stay high until the data is read, as a latched interrupt pin. t runs each time the
+// queue is empty and the pin rises, its callback sets it up for the next time. It stops after a
+// failure, until it is submitted again. Other transactions submitted meanwhile run first,
+// except from APP_IRQ_PRIORITY_HIGH: they wait for the next edge. Returns false if a trigger
+// is already set, or if t is queued or not a read.
+bool i2c_async_set_trigger(i2c_transaction_t *t, uint8_t pin);
+// Bus clock in kHz: 100, 250 or 400, false otherwise. Used from the next transaction.
+bool i2c_async_set_frequency(uint16_t khz);
+uint16_t i2c_async_get_frequency(void);
+
+#endif
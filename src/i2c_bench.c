@@ -0,0 +1,109 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "i2c_bench.h"
+#include "i2c_wrapper.h"
+#include "i2c_async.h"
+#include "high_res_timer.h"
+#include "printf.h"
+
+// The MPU answers at the same address in all the sensor sets
+#define MPU_ADDRESS      0x68
+#define ACCEL_XOUT_H     0x3B
+#define WHO_AM_I         0x75
+
+#define SOAK_READS       10000  // in all, the lengths taking turns (some 20 s at 100 kHz)
+#define SOAK_LEN_MAX     24     // up to the end of EXT_SENS_DATA, as the sample reads
+
+#define BENCH_READS      1000
+#define BENCH_BURST      14     // a sample: accel, temperature and gyro
+
+static const uint16_t bench_frequencies[] = { 100, 250, 400 };
+
+void i2c_stats_print(void)
+{
+    i2c_async_stats_t stats;
+
+    i2c_async_get_stats(&stats);
+    printf("I2C at %d kHz: %lu transactions, %lu errors, %lu lock-ups, %lu recoveries\r\n",
+           i2c_async_get_frequency(), (unsigned long)stats.transactions, (unsigned long)stats.errors,
+           (unsigned long)stats.lockups, (unsigned long)stats.recoveries);
+    printf("I2C bus: %lu clears, %lu stuck, worst latency %lu us\r\n",
+           (unsigned long)stats.bus_clears, (unsigned long)stats.bus_stuck,
+           (unsigned long)stats.worst_latency);
+}
+
+int i2c_soak_run(void)
+{
+    i2c_async_stats_t before, after;
+    uint8_t whoami, check;
+    uint8_t data[SOAK_LEN_MAX];
+    uint32_t failed = 0, corrupted = 0;
+    uint32_t start, elapsed;
+
+    if (i2c_read_bytes(MPU_ADDRESS, WHO_AM_I, 1, &whoami) != 0) {
+        printf("I2C soak: no answer from the MPU\r\n");
+        return 1;
+    }
+
+    i2c_async_get_stats(&before);
+    start = get_time();
+    for (int i = 0; i < SOAK_READS; i++) {
+        // All the lengths, for the single byte read and the stop before the last byte
+        if (i2c_read_bytes(MPU_ADDRESS, ACCEL_XOUT_H, 1 + i % SOAK_LEN_MAX, data) != 0)
+            failed++;
+        if (i2c_read_bytes(MPU_ADDRESS, WHO_AM_I, 1, &check) != 0)
+            failed++;
+        else if (check != whoami)
+            corrupted++;
+    }
+    elapsed = get_time() - start;
+    i2c_async_get_stats(&after);
+
+    // The bus errors and lock-ups also count those of the sample reads meanwhile
+    printf("I2C soak: %d reads of 1 to %d bytes, each checked by a WHO_AM_I read, in %lu ms\r\n",
+           SOAK_READS, SOAK_LEN_MAX, (unsigned long)(elapsed / 1000));
+    printf("I2C soak: %lu failed, %lu corrupted, %lu bus errors, %lu lock-ups\r\n",
+           (unsigned long)failed, (unsigned long)corrupted, (unsigned long)(after.errors - before.errors),
+           (unsigned long)(after.lockups - before.lockups));
+    return failed + corrupted;
+}
+
+// Time BENCH_READS reads of len bytes from reg. The latency includes the wait behind the
+// sample reads, if any is queued.
+static int bench_reads(const char *name, uint8_t reg, uint8_t len)
+{
+    uint8_t data[BENCH_BURST];
+    uint32_t start, t, total = 0, worst = 0;
+    int failed = 0;
+
+    for (int i = 0; i < BENCH_READS; i++) {
+        start = get_time();
+        if (i2c_read_bytes(MPU_ADDRESS, reg, len, data) != 0)
+            failed++;
+        t = get_time() - start;
+        total += t;
+        if (t > worst)
+            worst = t;
+    }
+
+    printf("  %s: %lu bytes/s, %lu us per read, max %lu us, %d failed\r\n", name,
+           (unsigned long)((uint64_t)BENCH_READS * len * 1000000 / total),
+           (unsigned long)(total / BENCH_READS), (unsigned long)worst, failed);
+    return failed;
+}
+
+int i2c_bench_run(void)
+{
+    uint16_t frequency = i2c_async_get_frequency();
+    int failed = 0;
+
+    for (int f = 0; f < sizeof bench_frequencies / sizeof bench_frequencies[0]; f++) {
+        i2c_async_set_frequency(bench_frequencies[f]);
+        printf("I2C bench at %d kHz, %d reads:\r\n", bench_frequencies[f], BENCH_READS);
+        failed += bench_reads("sample burst", ACCEL_XOUT_H, BENCH_BURST);
+        failed += bench_reads("single register", WHO_AM_I, 1);
+    }
+    i2c_async_set_frequency(frequency);
+    return failed;
+}
@@ -0,0 +1,19 @@
+#ifndef I2C_BENCH_H
+#define I2C_BENCH_H
+
+// Print the bus health counters of the TWI driver (see i2c_async_stats_t)
+void i2c_stats_print(void);
+
+// Soak test of the sensor bus: reads of the MPU registers, cycling through all the lengths
+// (SOAK_READS in all, not per length), each one followed by a check of WHO_AM_I to catch
+// shifted or corrupted data. Prints the failed and
+// corrupted reads, with the bus errors and lock-ups seen by the TWI driver meanwhile.
+// Returns the number of failed or corrupted reads.
+int i2c_soak_run(void);
+
+// Time sample burst reads and single register reads of the MPU at each bus clock, and print
+// the throughput (bytes/s of data) and the transaction latency. Returns the number of failed
+// reads.
+int i2c_bench_run(void);
+
+#endif
@@ -1,64 +1,67 @@
 #include <string.h>
+#include <stdbool.h>
 
 #include "i2c_wrapper.h"
+#include "i2c_async.h"
 #include "twi_master.h"
 #include "boards.h"
 #include "nrf_delay.h"
 
 // HAL for invensense:
 
-int i2c_init(void)
+int i2c_init(uint16_t frequency)
 {
     int ret = twi_master_init();
-        // TODO: check if it can be faster
+    i2c_async_init();
+    if (!i2c_async_set_frequency(frequency))
+        ret = false;
+#ifndef FAST_BOOT
+    // Let the sensors power up. With FAST_BOOT, imu_init() polls them instead.
     nrf_delay_ms(300);
+#endif
 
     // invensense expects an error code: 0 = OK, error otherwise
     return !ret;
 }
 
-int i2c_write_bytes(uint8_t devAddr, uint8_t regAddr, uint8_t dataLength, uint8_t const *data)
-{
-    devAddr <<= 1;
+// Synchronous accesses, queued with the asynchronous ones (see i2c_async.h)
+#define I2C_SYNC_TIMEOUT 50000UL    // us, more than a 255 bytes read at 100 kHz
 
-    const int bytes_num = 1 + dataLength;
-	uint8_t buffer[bytes_num];
-	buffer[0] = regAddr;
-    memcpy(buffer+1, data, dataLength);
+static int i2c_transfer(uint8_t devAddr, uint8_t regAddr, bool read, uint8_t dataLength, uint8_t *data)
+{
+    i2c_transaction_t t = {
+        .address = devAddr,
+        .reg     = regAddr,
+        .read    = read,
+        .length  = dataLength,
+        .data    = data,
+    };
+
+    if (!i2c_async_submit(&t))
+        return 1;
+    return !i2c_async_wait(&t, I2C_SYNC_TIMEOUT);
+}
 
-    return !twi_master_transfer(devAddr, buffer, bytes_num, TWI_ISSUE_STOP);
+int i2c_write_bytes(uint8_t devAddr, uint8_t regAddr, uint8_t dataLength, uint8_t const *data)
+{
+    // Only read from in a write
+    return i2c_transfer(devAddr, regAddr, false, dataLength, (uint8_t *)data);
 }
 
 int i2c_write_byte(uint8_t devAddr, uint8_t regAddr, uint8_t const data)
 {
-    devAddr <<= 1;
+    uint8_t buffer = data;
 
-	uint8_t buffer[2];
-	buffer[0] = regAddr;
-	buffer[1] = data;
-
-    return !twi_master_transfer(devAddr, buffer, 2, TWI_ISSUE_STOP);
+    return i2c_transfer(devAddr, regAddr, false, 1, &buffer);
 }
 
 
 int i2c_read_bytes(uint8_t devAddr, uint8_t regAddr, uint8_t dataLength, uint8_t *data)
 {
-    bool transfer_succeeded;
-    devAddr <<= 1;
-
-    transfer_succeeded  = twi_master_transfer(devAddr, &regAddr, 1, TWI_DONT_ISSUE_STOP);
-    transfer_succeeded &= twi_master_transfer(devAddr|TWI_READ_BIT, data, dataLength, TWI_ISSUE_STOP);
-
-    return !transfer_succeeded;
+    return i2c_transfer(devAddr, regAddr, true, dataLength, data);
 }
 
-uint8_t i2c_read_byte(uint8_t devAddr, uint8_t regAddr)
+int i2c_read_byte(uint8_t devAddr, uint8_t regAddr, uint8_t *data)
 {
-    uint8_t data;
-    devAddr <<= 1;
-
-    twi_master_transfer(devAddr, &regAddr, 1, TWI_DONT_ISSUE_STOP);
-    twi_master_transfer(devAddr|TWI_READ_BIT, &data, 1, TWI_ISSUE_STOP);
-
-    return data;
+    return i2c_transfer(devAddr, regAddr, true, 1, data);
 }
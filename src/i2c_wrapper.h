@@ -3,10 +3,19 @@
 
 #include <stdint.h>
 
-int i2c_init(void);
+// Bus clock (kHz). All the sensors support the fast mode.
+#ifdef I2C_400KHZ
+#define I2C_FREQUENCY 400
+#else
+#define I2C_FREQUENCY 100
+#endif
+
+// All return 0 on success, an error otherwise (as invensense expects)
+// frequency: 100, 250 or 400 kHz
+int i2c_init(uint16_t frequency);
 int i2c_write_byte(uint8_t devAddr, uint8_t regAddr, uint8_t const data);
 int i2c_write_bytes(uint8_t devAddr, uint8_t regAddr, uint8_t dataLength, uint8_t const *data);
-uint8_t i2c_read_byte(uint8_t  devAddr, uint8_t regAddr);
+int i2c_read_byte(uint8_t  devAddr, uint8_t regAddr, uint8_t *data);
 int i2c_read_bytes(uint8_t  devAddr, uint8_t regAddr, uint8_t dataLength, uint8_t *data);
 
 #endif // I2C_WRAPPER_H
@@ -4,12 +4,17 @@
 #include <string.h>
 #include "imu.h"
 #include "mpu9150.h"
+#include "mpu9150_dmp.h"
 #include "ak8975a.h"
+#include "ak8963.h"
+#include "mag_calibration.h"
 #include "fusion.h"
+#include "fast_math.h"
 #include "high_res_timer.h"
 #include "twi_advertising.h"
 #include "twi_calibration_store.h"
-#include "fusion.h"
+#include "fusion_bench.h"
+#include "i2c_bench.h"
 #include "i2c_wrapper.h"
 #include "app_util.h"
 #include "softdevice_handler.h"
@@ -18,10 +23,9 @@
 #include "leds.h"
 #include "nrf_gpio.h"
 
-// Vector to hold quaternion and AHRS results
+// Fusion filter state, holding the quaternion
 // XXX FIXME : need a mutex !
-static float q[4] = {1.0f, 0.0f, 0.0f, 0.0f};
-static float pitch, yaw, roll;
+static fusion_t fusion;
 
 // Variables to hold latest sensor data values
 static float ax, ay, az, gx, gy, gz, mx, my, mz;
@@ -34,37 +38,204 @@ calibration_data_t cal = {.mag_scale = {1., 0, 0, 0, 1., 0, 0, 0, 1.},
 };
 
 
-void imu_update()
+// Sensor sets: an accel and gyro part, with the compass it embeds (both AK parts answer the
+// same WHO_AM_I, the accel and gyro part tells them apart). The first one found is used.
+typedef struct {
+    const imu_motion_ops_t *motion;
+    const imu_mag_ops_t *mag;
+} imu_sensor_set_t;
+
+static const imu_sensor_set_t sensor_sets[] = {
+    {&mpu9150_ops, &ak8975a_ops},
+#ifndef MPU9150_DMP
+    // The DMP firmware and driver are built for the MPU9150 only
+    {&mpu9250_ops, &ak8963_ops},
+#endif
+};
+
+static const imu_motion_ops_t *motion;
+static const imu_mag_ops_t *mag;
+
+#define IMU_PROBE_TIMEOUT   300000UL    // us, sensors start-up time after the power-on
+
+
+// Multi-rate fusion: the gyro is integrated on every sample, while the accel / mag correction,
+// and the magnetometer read (the most expensive one) only happen at the correction rate.
+// A rate of 0 runs the full 9 DOF update on every sample. The compass drivers drop a measure
+// older than IMU_MAG_MAX_AGE, and a correction can come one sample late: slower rates, which
+// would never use the mag, are refused.
+#define IMU_CORRECTION_RATE_HZ  50
+#define IMU_CORRECTION_PERIOD_MAX (IMU_MAG_MAX_AGE / 2)    // us
+
+static uint32_t correction_period = 1000000UL / IMU_CORRECTION_RATE_HZ; // us
+
+bool imu_set_correction_rate(uint16_t hz)
 {
-    // Used to calculate integration interval
-    static int lastUpdate = 0, Now = 0;
+    if (hz && 1000000UL / hz > IMU_CORRECTION_PERIOD_MAX)
+        return false;
+    correction_period = hz ? 1000000UL / hz : 0;
+    return true;
+}
 
-    // If intPin goes high or NEW_DATA register is set, then all data registers have new data
-    // XXX FIXME : should do this in interrupt service
-    if (mpu9150_new_data()) {
-        static float data[6];
+// Magnetometer health: its data is dropped, and the fusion falls back to accel + gyro only, when
+// the measure overflows or saturates, or when the field norm is too far from the calibrated one
+// (iron or magnet nearby). After MAG_MAX_FAILURES failed measures in a row, for either reason, the
+// mag is not read at all for MAG_RETRY_PERIOD, which also saves the I2C time of the most
+// expensive read.
+#define MAG_MAX_FAILURES    5
+#define MAG_RETRY_PERIOD    1000000UL   // us
+#define MAG_NORM_TOLERANCE  0.25f       // accepted relative deviation of the field norm
+
+// Verdict on the latest measure, which the compass returns again until the next one: each
+// measure is only checked, and counted as a failure, once
+static bool mag_ok;
+
+// Reference field norm, when the calibration has none (cal.mag_norm, stored before it was
+// measured): learnt from the accepted measures. It is only established once MAG_NORM_SEED
+// measures in a row agree with each other, a single disturbed one must not become the
+// reference. Until then only overflow and saturation are checked. It is learnt again when the
+// mag is read again after MAG_RETRY_PERIOD, in case a wrong reference caused the failures.
+#define MAG_NORM_SEED       4
+static float mag_norm;
+static uint8_t mag_norm_count;  // agreeing measures in mag_norm, up to MAG_NORM_SEED
+static uint8_t mag_failures;
+static uint32_t mag_disabled_at;
+
+#ifdef MPU9150_AUX_MAG
+// Auxiliary I2C master mode: the MPU9150 reads the compass itself, and its data comes with the
+// accel and gyro burst, in this copy of the EXT_SENS_DATA registers
+static uint8_t mag_ext[IMU_MAG_AUX_LEN];
+#endif
+
+static void mag_failed(uint32_t now)
+{
+    if (++mag_failures >= MAG_MAX_FAILURES)
+        mag_disabled_at = now;
+}
 
-        // Read accel, temp and gyro data
-        mpu9150_read_data(data);
+// Reference norm for a measure of the given norm, 0 while the learnt one is not established
+static float mag_norm_reference(float norm)
+{
+    if (cal.mag_norm != 0.0f)
+        return cal.mag_norm;
+    if (mag_norm_count >= MAG_NORM_SEED)
+        return mag_norm;
+
+    if (mag_norm_count == 0 || fabsf(norm - mag_norm) > MAG_NORM_TOLERANCE * mag_norm) {
+        // Disagrees with the previous ones: start again from this one
+        mag_norm = norm;
+        mag_norm_count = 1;
+    }
+    else {
+        mag_norm_count++;
+        mag_norm += (norm - mag_norm) / mag_norm_count;
+    }
+    return 0.0f;
+}
 
-        ax = data[0];
-        ay = data[1];
-        az = data[2];
+// Read the magnetometer in mx, my, mz. Returns false if it should not be used for this update.
+static bool read_mag(uint32_t now)
+{
+    imu_mag_read_t result;
+    float norm, ref;
+
+    if (mag_failures >= MAG_MAX_FAILURES) {
+        if (now - mag_disabled_at < MAG_RETRY_PERIOD)
+            return false;
+        mag_failures = 0;
+        mag_norm_count = 0;
+    }
 
-        gx = data[3];
-        gy = data[4];
-        gz = data[5];
+#ifdef MPU9150_AUX_MAG
+    result = mag->read_aux(mag_ext, &mx, &my, &mz);
+#else
+    result = mag->read(&mx, &my, &mz);
+#endif
+    if (result == IMU_MAG_SAME)
+        return mag_ok;
+    mag_ok = false;
+    if (result == IMU_MAG_NONE)
+        return false;
+    if (result == IMU_MAG_INVALID) {
+        mag_failed(now);
+        return false;
+    }
 
-        // Get mag data
-        ak8975a_read_data(&mx, &my, &mz);
+    norm = sqrtf(mx * mx + my * my + mz * mz);
+    ref = mag_norm_reference(norm);
+    if (ref != 0.0f && fabsf(norm - ref) > MAG_NORM_TOLERANCE * ref) {
+        mag_failed(now);
+        return false;
     }
+    mag_failures = 0;
+    mag_ok = true;
+    if (cal.mag_norm == 0.0f && ref != 0.0f)
+        mag_norm += 0.01f * (norm - mag_norm);  // slow low pass, a disturbance must not drag it
+
+    return true;
+}
+
+static void imu_update_sample(void)
+{
+    // Used to calculate integration intervals
+    static uint32_t lastUpdate = 0, lastCorrection = 0;
+    uint32_t Now;
+
+    // The data ready interrupt tells when all data registers have new data
+    if (!motion->new_data())
+        return;
+
+    static float data[6];
+
+    // Read accel, temp and gyro data
+#ifdef MPU9150_AUX_MAG
+    // ... and the mag, all in one transaction
+    motion->read_block_ext(data, mag_ext, IMU_MAG_AUX_LEN);
+#else
+    motion->read_block(data);
+#endif
+
+    ax = data[0];
+    ay = data[1];
+    az = data[2];
+
+    gx = data[3];
+    gy = data[4];
+    gz = data[5];
 
     // Get integration time by time elapsed since last filter update
     Now = get_time();
     float dt = (float)((Now - lastUpdate)/1000000.0f) ;
     lastUpdate = Now;
+    // ... or from the sensor clock, without the jitter of the main loop, when it times the reads
+    uint8_t n = motion->samples_read();
+    if (n > 0)
+        dt = n * motion->sample_period() / 1000000.0f;
 
-    madgwick_quaternion_update(ax, ay, az, gx, gy, gz, mx, my, mz, dt, q);
+    if (correction_period == 0) {
+        // Get mag data
+        if (read_mag(Now))
+            fusion_update(&fusion, ax, ay, az, gx, gy, gz, mx, my, mz, dt);
+        else
+            fusion_update_imu(&fusion, ax, ay, az, gx, gy, gz, dt);
+    }
+    else {
+        fusion_predict(&fusion, gx, gy, gz, dt);
+
+        uint32_t elapsed = Now - lastCorrection;
+        if (elapsed >= correction_period) {
+            // Don't let the first correction (or one after a long stall) make a huge step
+            if (elapsed > 2 * correction_period)
+                elapsed = correction_period;
+            lastCorrection = Now;
+
+            // Get mag data
+            if (read_mag(Now))
+                fusion_correct(&fusion, ax, ay, az, mx, my, mz, elapsed / 1000000.0f);
+            else
+                fusion_correct_imu(&fusion, ax, ay, az, elapsed / 1000000.0f);
+        }
+    }
 
 #if 0
     printf("ax=%04.2f, ay=%04.2f, az=%04.2f, gx=%04.2f, gy=%04.2f, gz=%04.2f, mx=%04.2f, my=%04.2f, mz=%04.2f\r\n",
@@ -72,9 +243,131 @@ void imu_update()
 #endif
 }
 
-// Set global variables : yaw, pitch and roll
-// Called from CRITIAL_REGION_ENTER : NO PRINTF with IRQ ALLOWED HERE ! Only simple "simple_uart" calls !
-static inline void update_euler_from_quaternions(void)
+#ifdef MPU9150_FIFO
+// FIFO mode: the samples pile up in the MPU FIFO and are fused by blocks (see
+// fusion_update_batch()), with a single mag read per block. The MPU clock gives the sample
+// timestamps. The multi-rate correction does not apply here.
+// FIFO_COUNT decides when a block is there. It is read once the data ready pulses signalled a
+// block, and at least once per block period anyway: a missed pulse must not stall the drain
+// until the FIFO overflows.
+#define IMU_FIFO_BLOCK  4   // samples
+#define IMU_FIFO_MAX    16
+
+static void imu_update_fifo(void)
+{
+    static float data[IMU_FIFO_MAX * 6];
+    static fusion_sample_t samples[IMU_FIFO_MAX];
+    static uint32_t polled_at;
+    uint32_t period = motion->sample_period();
+    uint32_t now = get_time();
+    float dt = period / 1000000.0f;
+    int n;
+
+    if (motion->fifo_pending() < IMU_FIFO_BLOCK && now - polled_at < IMU_FIFO_BLOCK * period)
+        return;
+    polled_at = now;
+
+    // Not a whole block yet, or an overflow: the FIFO was reset and the samples lost
+    n = motion->read_fifo(data, IMU_FIFO_BLOCK, IMU_FIFO_MAX);
+    if (n <= 0)
+        return;
+
+    for (int i = 0; i < n; i++) {
+        samples[i].ax = data[6 * i];
+        samples[i].ay = data[6 * i + 1];
+        samples[i].az = data[6 * i + 2];
+        samples[i].gx = data[6 * i + 3];
+        samples[i].gy = data[6 * i + 4];
+        samples[i].gz = data[6 * i + 5];
+        samples[i].dt = dt;
+    }
+    ax = samples[n - 1].ax;
+    ay = samples[n - 1].ay;
+    az = samples[n - 1].az;
+    gx = samples[n - 1].gx;
+    gy = samples[n - 1].gy;
+    gz = samples[n - 1].gz;
+
+#ifdef MPU9150_AUX_MAG
+    motion->read_ext(mag_ext, IMU_MAG_AUX_LEN);
+#endif
+    if (read_mag(get_time()))
+        fusion_update_batch(&fusion, samples, n, mx, my, mz);
+    else
+        for (int i = 0; i < n; i++)
+            fusion_update_imu(&fusion, samples[i].ax, samples[i].ay, samples[i].az,
+                              samples[i].gx, samples[i].gy, samples[i].gz, dt);
+}
+#endif
+
+#ifdef MPU9150_DMP
+#if defined MPU9150_FIFO || defined MPU9150_AUX_MAG
+#error "MPU9150_DMP owns the MPU FIFO and its auxiliary I2C master"
+#endif
+// DMP mode: the MPU9150 fuses accel and gyro (see mpu9150_dmp.h), the mag only corrects the
+// heading of its quaternion, at the correction rate.
+#define IMU_DMP_MAX  8      // packets read per update
+
+static void imu_update_dmp(void)
+{
+    static uint32_t lastCorrection = 0;
+    static float q[4], data[3];
+    uint32_t Now;
+    int n = 0, more;
+
+    if (!motion->new_data())
+        return;
+
+    // Drain the FIFO, only the last quaternion matters
+    do {
+        more = mpu9150_dmp_read(q, data);
+        if (more >= 0)
+            n++;
+    } while (more > 0 && n < IMU_DMP_MAX);
+    if (n == 0)
+        return;
+
+    ax = data[0];
+    ay = data[1];
+    az = data[2];
+
+    Now = get_time();
+    uint32_t elapsed = Now - lastCorrection;
+    if (elapsed >= correction_period) {
+        if (elapsed > 2 * correction_period)
+            elapsed = correction_period;
+        lastCorrection = Now;
+
+        if (read_mag(Now)) {
+            fusion_correct_heading(&fusion, q, mx, my, mz, elapsed / 1000000.0f);
+            return;
+        }
+    }
+    fusion_update_heading(&fusion, q);
+}
+#endif
+
+void imu_update()
+{
+#if defined MPU9150_DMP
+    imu_update_dmp();
+#elif defined MPU9150_FIFO
+    imu_update_fifo();
+#else
+    imu_update_sample();
+#endif
+
+    // Calibration data learnt by the driver (a new gyro bias temperature bin) is worth
+    // keeping, the driver bounds the number of flash writes
+    if (motion->calibration_learnt())
+        calibration_store_write(&cal);
+}
+
+// Declination at Paris, 2014
+#define DECLINATION (int16_t)(4.11f * ANGLE16_PER_DEG)
+
+// Yaw, pitch and roll, directly in the 16 bit advertising format (see fast_math.h)
+static inline void euler_from_quaternion(const float *q, int16_t *euler)
 {
     // Define output variables from updated quaternion---these are Tait-Bryan angles,
     // commonly used in aircraft orientation.
@@ -90,26 +383,63 @@ static inline void update_euler_from_quaternions(void)
     // is yaw, pitch, and then roll.
     // For more see http://en.wikipedia.org/wiki/Conversion_between_quaternions_and_Euler_angles
     // which has additional links.
-    yaw   = atan2(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
-    pitch = -asin(2.0f * (q[1] * q[3] - q[0] * q[2]));
-    roll  = atan2(2.0f * (q[0] * q[1] + q[2] * q[3]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
-    pitch *= 180.0f / M_PI;
-    yaw   *= 180.0f / M_PI;
-    yaw   -= 4.11f; // Declination at Paris, 2014
-    roll  *= 180.0f / M_PI;
+    euler[0] = atan2_angle16(2.0f * (q[1] * q[2] + q[0] * q[3]), q[0] * q[0] + q[1] * q[1] - q[2] * q[2] - q[3] * q[3]);
+    euler[1] = -asin_angle16(2.0f * (q[1] * q[3] - q[0] * q[2]));
+    euler[2] = atan2_angle16(2.0f * (q[0] * q[1] + q[2] * q[3]), q[0] * q[0] - q[1] * q[1] - q[2] * q[2] + q[3] * q[3]);
+    euler[0] -= DECLINATION;    // wraps around
+}
+
+// The sensor drivers work on fixed-point copies of the calibration data
+static void imu_apply_calibration(void)
+{
+    motion->apply_calibration();
+    mag_calibration_apply();
 }
 
 void imu_init(void)
 {
     // Init I2C
-    i2c_init();
+    i2c_init(I2C_FREQUENCY);
+
+    // Find the sensors, polling them until they are up after the power-on
+    uint32_t start = get_time();
+    do {
+        for (unsigned int i = 0; i < sizeof sensor_sets / sizeof sensor_sets[0]; i++)
+            if (sensor_sets[i].motion->probe()) {
+                motion = sensor_sets[i].motion;
+                mag = sensor_sets[i].mag;
+                break;
+            }
+    } while (motion == NULL && get_time() - start < IMU_PROBE_TIMEOUT);
+    if (motion == NULL) {
+        printf("ERROR : no supported IMU found\n\r");
+        APP_ERROR_CHECK_BOOL(false);
+    }
+    printf("IMU : %s + %s\n\r", motion->name, mag->name);
 
     // Init MPU
-    mpu9150_reset();
-    mpu9150_init();
+    motion->init();
 
-    // Init Mag
-    ak8975a_init();
+    // Init Mag, reached in bypass mode once the MPU is initialised
+    if (!mag->probe()) {
+        printf("ERROR : no %s found\n\r", mag->name);
+        APP_ERROR_CHECK_BOOL(false);
+    }
+    mag->init();
+    imu_apply_calibration();
+#ifdef MPU9150_AUX_MAG
+    mag->aux_enable(true);
+#endif
+#ifdef MPU9150_DMP
+    mpu9150_dmp_init();
+#endif
+
+    // Init fusion
+#ifdef FUSION_FIXED_POINT
+    fusion_init(&fusion, FUSION_MADGWICK_FIXED);
+#else
+    fusion_init(&fusion, FUSION_MADGWICK);
+#endif
 
     // Allow calibration with button:
     nrf_gpio_cfg_input(BUTTON, NRF_GPIO_PIN_PULLDOWN);
@@ -121,40 +451,90 @@ static inline uint16_t byte_swap(uint16_t val) {
 }
 
 static inline uint16_t format_accel(float val) {
-    return byte_swap((uint16_t) val);
+    // Wider ranges than 2 g saturate
+    if (val > 32767.0f)
+        val = 32767.0f;
+    else if (val < -32768.0f)
+        val = -32768.0f;
+    return byte_swap((uint16_t)(int16_t) val);
 }
 
-static inline uint16_t format_euler(float val) {
-    // normalize from 360 deg to 16 bits, keep precision and sign
-    int16_t norm = (int16_t) (val / 360.0 * 65536.0);
-
-    return byte_swap((uint16_t) norm);
+static inline uint16_t format_euler(int16_t val) {
+    // already normalized from 360 deg to 16 bits
+    return byte_swap((uint16_t) val);
 }
 
 imu_data_t * get_imu_data(imu_data_t * imu_data)
 {
+    float q[4], a[3];
+    int16_t euler[3];
+
+    // Only take a consistent snapshot with IRQs disabled, the conversions are done outside
     CRITICAL_REGION_ENTER();
+    memcpy(q, fusion.q, sizeof q);
+    a[0] = ax;
+    a[1] = ay;
+    a[2] = az;
+    CRITICAL_REGION_EXIT();
 
-    imu_data->accel[0] = format_accel(ax);
-    imu_data->accel[1] = format_accel(ay);
-    imu_data->accel[2] = format_accel(az);
+    imu_data->accel[0] = format_accel(a[0]);
+    imu_data->accel[1] = format_accel(a[1]);
+    imu_data->accel[2] = format_accel(a[2]);
 
-    update_euler_from_quaternions();
+    euler_from_quaternion(q, euler);
 
-    imu_data->euler[0] = format_euler(yaw);
-    imu_data->euler[1] = format_euler(pitch);
-    imu_data->euler[2] = format_euler(roll);
+    imu_data->euler[0] = format_euler(euler[0]);
+    imu_data->euler[1] = format_euler(euler[1]);
+    imu_data->euler[2] = format_euler(euler[2]);
 
-    CRITICAL_REGION_EXIT();
     return imu_data;
 }
 
+// Scale of the 3 smallest components, within +/-1/sqrt(2)
+#define QUAT_SCALE (1.41421356f * 32767.0f)
+
+imu_quat_data_t * get_imu_quat_data(imu_quat_data_t * imu_data)
+{
+    float q[4], a[3];
+    int big = 0;
+
+    CRITICAL_REGION_ENTER();
+    memcpy(q, fusion.q, sizeof q);
+    a[0] = ax;
+    a[1] = ay;
+    a[2] = az;
+    CRITICAL_REGION_EXIT();
+
+    imu_data->accel[0] = format_accel(a[0]);
+    imu_data->accel[1] = format_accel(a[1]);
+    imu_data->accel[2] = format_accel(a[2]);
+
+    for (int i = 1; i < 4; i++)
+        if (q[i] * q[i] > q[big] * q[big])
+            big = i;
+    imu_data->format = (IMU_QUAT_FORMAT_VERSION << 4) | big;
+
+    for (int i = 0, j = 0; i < 4; i++) {
+        if (i == big)
+            continue;
+        float val = (q[big] < 0.0f ? -q[i] : q[i]) * QUAT_SCALE;
+        int32_t c = (int32_t)(val < 0.0f ? val - 0.5f : val + 0.5f);
+        if (c > 32767)
+            c = 32767;
+        if (c < -32767)
+            c = -32767;
+        imu_data->quat[j++] = byte_swap((uint16_t)c);
+    }
+
+    return imu_data;
+}
 
 bool imu_load_calibration_data()
 {
     calibration_data_t temp;
     if (calibration_store_load(&temp)) {
         memcpy(&cal, &temp, sizeof cal);
+        imu_apply_calibration();
         return true;
     }
     else {
@@ -181,20 +561,63 @@ void imu_store_calibration_data()
 #define END_CAL_ACC_GYRO   ('s')
 #define READ_CAL_DATA      ('r')
 #define READ_DATA          ('d')
+#define FUSION_BENCH       ('b')
+#define SENSOR_CONFIG      ('f')
+#define CORRECTION_RATE    ('c')
+#define SELF_TEST          ('t')
+#define I2C_SOAK           ('i')
+#define I2C_BENCH          ('p')
+#define I2C_STATS          ('e')
 #define QUIT               ('q')
 
-void imu_calibrate(bool button_was_pressed)
+// Reference for the mag health check: the mean norm of MAG_NORM_SAMPLES calibrated measures,
+// taken right after the GUI sent the calibration, at the same place. 0 without any measure.
+#define MAG_NORM_SAMPLES   8
+
+// Blocking mag reads tried before giving up on a calibration command (each one waits up to
+// twice the measurement time)
+#define MAG_READ_RETRIES   10
+// Same for the non-blocking reads, as a time limit
+#define MAG_READ_TIMEOUT   200000UL    // us
+
+static float measure_mag_norm(void)
+{
+    int16_t data[3];
+    float x, y, z, sum = 0.0f;
+    int n = 0;
+
+    for (int i = 0; i < MAG_NORM_SAMPLES; i++) {
+        if (!mag->read_raw(data))
+            continue;
+        mag_calibration_correct(data, &x, &y, &z);
+        sum += sqrtf(x * x + y * y + z * z);
+        n++;
+    }
+    return n ? sum / n : 0.0f;
+}
+
+static void calibrate(bool button_was_pressed)
 {
     /* Offline calibration for MPU9150 : the user is asked (through the python
        calibration GUI) to move the TWIMU in all directions or to let is standing still horizontaly.
        The python GUI interacts with user through these simple commands :
          "m" : aks for a new raw mag value.
          "s" : sends 12 lines with each of the mag calibration coefficients in signed decimal ASCII form
+               (the nRF then measures the calibrated field norm, the mag health check reference)
          "w" : asks to store the calibration data in flash
          "a" : start accel and gyroscope biases calulation (IMU must be standing still and horizontaly)
          "s" : sent by nRF to signal the end of accel and gyroscope biases calculation
          "q" : stops calibration routine
          "r" : display calibration data
+         "b" : run the fusion filters on a synthetic stream and display their speed and accuracy
+         "f" : set the sensor configuration, from 4 lines: accel range (g), gyro range (deg/s),
+               DLPF setting (1 to 6) and output rate (Hz)
+         "c" : set the accel / mag correction rate, from 1 line (Hz, 0 corrects on every sample,
+               otherwise 20 Hz at least)
+         "t" : run the sensors self tests (IMU must be standing still)
+         "i" : soak test the sensor bus, display the failed reads, bus errors and lock-ups
+         "p" : time the sensor bus reads at each clock, display the throughput and latency
+         "e" : display the sensor bus errors, recoveries and worst latency
     */
 
 #define BUF_SIZE 48
@@ -215,8 +638,16 @@ void imu_calibrate(bool button_was_pressed)
         switch (buf[0]) {
         case NEW_MAG :
             // If new raw mag values are asked for, then send them (ending with \r\n)
-            ak8975a_read_raw_data(data);
-            printf("%d %d %d\r\n", data[0], data[1], data[2]);
+            // The calibration GUI needs a valid measure, try a few times, then send an error
+            // line in place of the values (a saturated compass never gives one)
+            {
+                int retries = MAG_READ_RETRIES;
+                while (!mag->read_raw(data) && --retries > 0);
+                if (retries > 0)
+                    printf("%d %d %d\r\n", data[0], data[1], data[2]);
+                else
+                    printf("ERROR : no valid mag measure\r\n");
+            }
             printf("%c: done.\r\n", buf[0]);
             break;
 
@@ -233,6 +664,8 @@ void imu_calibrate(bool button_was_pressed)
                 getline(BUF_SIZE, buf);
                 *val++ = atof(buf);
             }
+            imu_apply_calibration();
+            cal.mag_norm = measure_mag_norm();
 
             printf("Mag scale = %f %f %f\r\n%f %f %f\r\n%f %f %f\r\n",
                    cal.mag_scale[0], cal.mag_scale[1], cal.mag_scale[2],
@@ -240,6 +673,7 @@ void imu_calibrate(bool button_was_pressed)
                    cal.mag_scale[6], cal.mag_scale[7], cal.mag_scale[8]);
             printf("Mag offset = %f %f %f\r\n",
                    cal.mag_offset[0], cal.mag_offset[1], cal.mag_offset[2]);
+            printf("Mag norm = %f\r\n", cal.mag_norm);
             printf("%c: done.\r\n", buf[0]);
             break;
 
@@ -247,7 +681,7 @@ void imu_calibrate(bool button_was_pressed)
             // Turn on LED
             led_on(LED_G);
             // Start bias measures
-            mpu9150_measure_biases();
+            motion->measure_biases();
             // Turn off LED
             led_off(LED_G);
 
@@ -280,10 +714,78 @@ void imu_calibrate(bool button_was_pressed)
                    cal.mag_scale[6], cal.mag_scale[7], cal.mag_scale[8]);
             printf("Mag offset = %f %f %f\r\n",
                    cal.mag_offset[0], cal.mag_offset[1], cal.mag_offset[2]);
+            printf("Mag norm = %f\r\n", cal.mag_norm);
             printf("Accel bias = %f %f %f\r\n",
                    cal.accel_bias[0], cal.accel_bias[1], cal.accel_bias[2]);
             printf("Gyro bias = %f %f %f\r\n",
                    cal.gyro_bias[0], cal.gyro_bias[1], cal.gyro_bias[2]);
+            for (int i = 0; i < GYRO_TEMP_BINS; i++)
+                if (cal.gyro_temp_valid & (1UL << i))
+                    printf("Gyro bias at %d C = %f %f %f\r\n", 18 + 4 * i,
+                           cal.gyro_temp_bias[i][0], cal.gyro_temp_bias[i][1], cal.gyro_temp_bias[i][2]);
+            printf("%c: done.\r\n", buf[0]);
+            break;
+
+        case FUSION_BENCH :
+            fusion_bench_run();
+            printf("%c: done.\r\n", buf[0]);
+            break;
+
+        case SENSOR_CONFIG :
+            {
+                int config[4];
+                for (int i = 0; i < 4; i++) {
+                    getline(BUF_SIZE, buf);
+                    config[i] = atoi(buf);
+                }
+#ifdef MPU9150_DMP
+                (void)config;
+                printf("Not available, the DMP sets its own configuration\r\n");
+#else
+                if (motion->set_rate(config[0], config[1], config[2], config[3]))
+                    printf("Accel %d g, gyro %d deg/s, DLPF %d, sample period %lu us\r\n",
+                           config[0], config[1], config[2], (unsigned long)motion->sample_period());
+                else
+                    printf("Invalid configuration\r\n");
+#endif
+            }
+            printf("%c: done.\r\n", SENSOR_CONFIG);
+            break;
+
+        case CORRECTION_RATE :
+            {
+                getline(BUF_SIZE, buf);
+                int hz = atoi(buf);
+                if (hz >= 0 && hz <= UINT16_MAX && imu_set_correction_rate(hz))
+                    printf("Correction rate = %d Hz\r\n", hz);
+                else
+                    printf("Invalid rate, %lu Hz at least\r\n",
+                           1000000UL / IMU_CORRECTION_PERIOD_MAX);
+            }
+            printf("%c: done.\r\n", CORRECTION_RATE);
+            break;
+
+        case SELF_TEST :
+            {
+                bool motion_pass = motion->self_test();
+                bool mag_pass = mag->self_test();
+                printf("Self test %s\r\n", motion_pass && mag_pass ? "passed" : "FAILED");
+            }
+            printf("%c: done.\r\n", buf[0]);
+            break;
+
+        case I2C_SOAK :
+            i2c_soak_run();
+            printf("%c: done.\r\n", buf[0]);
+            break;
+
+        case I2C_BENCH :
+            i2c_bench_run();
+            printf("%c: done.\r\n", buf[0]);
+            break;
+
+        case I2C_STATS :
+            i2c_stats_print();
             printf("%c: done.\r\n", buf[0]);
             break;
 
@@ -297,12 +799,21 @@ void imu_calibrate(bool button_was_pressed)
             {
                 float mx, my, mz;
                 float acc_gyro_data[6];
-                ak8975a_read_data(&mx, &my, &mz);
-                mpu9150_read_data(acc_gyro_data);
-                printf("%f %f %f %f %f %f %f %f %f\r\n",
-                       acc_gyro_data[0], acc_gyro_data[1], acc_gyro_data[2],
-                       acc_gyro_data[3], acc_gyro_data[4], acc_gyro_data[5],
-                       mx, my, mz);
+                uint32_t start = get_time();
+                imu_mag_read_t result;
+                // The measure is non-blocking, wait for one, for a while
+                do
+                    result = mag->read(&mx, &my, &mz);
+                while (result != IMU_MAG_NEW && result != IMU_MAG_SAME
+                       && get_time() - start < MAG_READ_TIMEOUT);
+                motion->read_block(acc_gyro_data);
+                if (result == IMU_MAG_NEW || result == IMU_MAG_SAME)
+                    printf("%f %f %f %f %f %f %f %f %f\r\n",
+                           acc_gyro_data[0], acc_gyro_data[1], acc_gyro_data[2],
+                           acc_gyro_data[3], acc_gyro_data[4], acc_gyro_data[5],
+                           mx, my, mz);
+                else
+                    printf("ERROR : no valid mag measure\r\n");
                 printf("%c: done.\r\n", buf[0]);
             }
             break;
@@ -311,3 +822,19 @@ void imu_calibrate(bool button_was_pressed)
         }
     }
 }
+
+void imu_calibrate(bool button_was_pressed)
+{
+#ifdef MPU9150_AUX_MAG
+    // The calibration reads the compass directly, in bypass mode
+    mag->aux_enable(false);
+    calibrate(button_was_pressed);
+    mag->aux_enable(true);
+#else
+    calibrate(button_was_pressed);
+#endif
+#ifdef MPU9150_DMP
+    // The bias measure resets the MPU, load the DMP again (with the new gyro biases)
+    mpu9150_dmp_init();
+#endif
+}
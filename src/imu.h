@@ -7,9 +7,23 @@ typedef struct imu_data_s {
     uint16_t euler[3]; // yaw, pitch, roll
 } imu_data_t;
 
+// Quaternion format (ADV_QUATERNION build), "smallest three" compression: the largest
+// component is dropped, made positive by the sign choice (q and -q are the same rotation)
+// and rebuilt by the receiver from the unit norm. The 3 others are within +/-1/sqrt(2),
+// they are sent scaled by sqrt(2) * 32767.
+#define IMU_QUAT_FORMAT_VERSION 1
+
+typedef struct __attribute__((packed)) imu_quat_data_s {
+    uint8_t format;    // IMU_QUAT_FORMAT_VERSION << 4 | index of the dropped component
+    uint16_t accel[3]; // x, y, z
+    uint16_t quat[3];  // the 3 other components (w, x, y, z order)
+} imu_quat_data_t;
+
 void imu_init(void);
 void imu_update(void);
+bool imu_set_correction_rate(uint16_t hz);
 imu_data_t * get_imu_data(imu_data_t * imu_data);
+imu_quat_data_t * get_imu_quat_data(imu_quat_data_t * imu_data);
 void imu_calibrate(bool button_was_pressed);
 bool imu_load_calibration_data(void);
 
@@ -21,6 +35,13 @@ bool imu_load_calibration_data(void);
 //      O (mag_offset) is the vertical offset 1x3 vector defined below
 //   Accel and gyro :
 //      biases...
+//   Gyro bias temperature model : gyro bias learnt per temperature bin (GYRO_TEMP_BINS bins
+//   of 4 deg C, centered on 18, 22, ... deg C), valid when its bit is set in gyro_temp_valid.
+//   It is stored after magic2, behind its own magic, so data stored without it stays valid.
+//   Magnetometer field norm : norm of the calibrated measures at the calibration place, the
+//   reference of the mag health check (0 if unknown). Stored behind magic4, the same way.
+
+#define GYRO_TEMP_BINS 8
 
 typedef struct {
     uint32_t magic1;
@@ -29,6 +50,11 @@ typedef struct {
     float gyro_bias[3];
     float accel_bias[3];
     uint32_t magic2;
+    float gyro_temp_bias[GYRO_TEMP_BINS][3];
+    uint32_t gyro_temp_valid;
+    uint32_t magic3;
+    float mag_norm;
+    uint32_t magic4;
 } calibration_data_t;
 
 extern calibration_data_t cal;
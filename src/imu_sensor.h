@@ -0,0 +1,68 @@
+#ifndef IMU_SENSOR_H
+#define IMU_SENSOR_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Sensor driver operations. imu.c only reaches the sensors through these tables, so that
+// another part is supported by its driver and a new entry in the sensor sets of imu.c,
+// without touching the fusion or the advertising.
+
+// Accel and gyro part. Samples are 6 values in the units the fusion expects, biases removed:
+// accel x, y, z in LSB at 2 g, then gyro x, y, z in rad/s.
+typedef struct {
+    const char *name;
+    bool (*probe)(void);            // true if this part answers on the bus (and select it)
+    void (*init)(void);             // reset and configure, the data ready interrupt running
+    bool (*new_data)(void);         // true once per new sample
+    void (*read_block)(float *values);
+    // Same, plus ext_len bytes copied from the auxiliary I2C slaves
+    void (*read_block_ext)(float *values, uint8_t *ext, uint8_t ext_len);
+    void (*read_ext)(uint8_t *ext, uint8_t ext_len);
+    // FIFO mode: samples signalled since the last FIFO count read (a hint, pulses may be
+    // missed), and the drain: nothing under min samples in the FIFO (by its count), else up
+    // to max samples, oldest first
+    uint8_t (*fifo_pending)(void);
+    int (*read_fifo)(float *values, int min, int max);
+    // Ranges (g, deg/s), DLPF setting and output rate (Hz). False if not supported.
+    bool (*set_rate)(uint8_t accel_g, uint16_t gyro_dps, uint8_t dlpf, uint16_t rate_hz);
+    uint32_t (*sample_period)(void);    // us
+    // Samples since the previous read_block, if the sensor clock alone times the reads, else
+    // 0 (the caller times them)
+    uint8_t (*samples_read)(void);
+    void (*measure_biases)(void);       // device standing still and horizontal
+    void (*apply_calibration)(void);    // after any change of the calibration data
+    bool (*calibration_learnt)(void);   // true once after the driver updated cal itself
+    bool (*self_test)(void);
+} imu_motion_ops_t;
+
+// Magnetometer. Measures are raw LSB, in the accel and gyro axes; the calibration (see
+// mag_calibration.h) is common to all the parts.
+#define IMU_MAG_AUX_LEN 8   // bytes read by the auxiliary I2C master, at most
+#define IMU_MAG_MAX_AGE 100000UL    // us, an older measure is not used (mag reads paused)
+
+// Non-blocking read results. The compass is slower than the fusion: each measure is reported
+// once, as new or invalid, then the latest valid one is returned again until the next one.
+typedef enum {
+    IMU_MAG_NONE,       // no usable measure (none yet, or an invalid or outdated one)
+    IMU_MAG_INVALID,    // a new measure came in, unusable (overflow, saturation)
+    IMU_MAG_NEW,        // a new measure
+    IMU_MAG_SAME,       // no new measure, the latest one again
+} imu_mag_read_t;
+
+typedef struct {
+    const char *name;
+    bool (*probe)(void);            // true if a compass answers (reached in bypass mode)
+    void (*init)(void);
+    // Blocking read of an uncalibrated measure, for the calibration. False if unusable.
+    bool (*read_raw)(int16_t *val);
+    // Non-blocking read of the latest calibrated measure, set unless IMU_MAG_NONE or INVALID
+    imu_mag_read_t (*read)(float *mx, float *my, float *mz);
+    // Auxiliary I2C master mode: the accel and gyro part reads the compass itself, and
+    // read_aux() parses the bytes it copied
+    void (*aux_enable)(bool enable);
+    imu_mag_read_t (*read_aux)(const uint8_t *ext, float *mx, float *my, float *mz);
+    bool (*self_test)(void);
+} imu_mag_ops_t;
+
+#endif
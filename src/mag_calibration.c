@@ -0,0 +1,48 @@
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "mag_calibration.h"
+#include "imu.h"
+#include "fast_math.h"
+
+// Calibration in fixed point, derived from cal by mag_calibration_apply(): integer offsets
+// (below the LSB, the fractional part is noise), and the scale matrix scaled by a common
+// power of 2, putting its largest coefficient in [2^12, 2^13[. With measures up to 16 bit,
+// the matrix products fit 32 bits.
+static int32_t mag_offset_q[3];
+static int32_t mag_scale_q[9];
+static float mag_unit = 1.0f;      // value of 1 in the matrix products
+
+void mag_calibration_apply(void)
+{
+    float max = 0.0f, f = 1.0f;
+
+    for (int i = 0; i < 9; i++) {
+        float a = cal.mag_scale[i] < 0.0f ? -cal.mag_scale[i] : cal.mag_scale[i];
+        if (a > max)
+            max = a;
+    }
+    if (max > 0.0f) {
+        while (max * f >= 8192.0f)
+            f *= 0.5f;
+        while (max * f < 4096.0f)
+            f *= 2.0f;
+    }
+
+    for (int i = 0; i < 3; i++)
+        mag_offset_q[i] = float_to_fixed(cal.mag_offset[i], 0);
+    for (int i = 0; i < 9; i++)
+        mag_scale_q[i] = float_to_fixed(cal.mag_scale[i] * f, 0);
+    mag_unit = 1.0f / f;
+}
+
+// Apply the calibration
+void mag_calibration_correct(const int16_t *data, float *mx, float *my, float *mz)
+{
+    int32_t x = data[0] - mag_offset_q[0];
+    int32_t y = data[1] - mag_offset_q[1];
+    int32_t z = data[2] - mag_offset_q[2];
+    *mx = (float)(x*mag_scale_q[0] + y*mag_scale_q[1] + z*mag_scale_q[2]) * mag_unit;
+    *my = (float)(x*mag_scale_q[3] + y*mag_scale_q[4] + z*mag_scale_q[5]) * mag_unit;
+    *mz = (float)(x*mag_scale_q[6] + y*mag_scale_q[7] + z*mag_scale_q[8]) * mag_unit;
+}
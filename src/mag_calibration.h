@@ -0,0 +1,13 @@
+#ifndef MAG_CALIBRATION_H
+#define MAG_CALIBRATION_H
+
+#include <stdint.h>
+
+// Magnetometer calibration (cal.mag_scale and cal.mag_offset, see imu.h), shared by the
+// compass drivers. Measures are raw LSB, up to 16 bit, in the accel and gyro axes.
+
+// Derive the fixed-point calibration, after any change of the calibration data
+void mag_calibration_apply(void);
+void mag_calibration_correct(const int16_t *data, float *mx, float *my, float *mz);
+
+#endif
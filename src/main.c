@@ -11,6 +11,77 @@
 #include "twi_scheduler.h"
 #include "twi_calibration_store.h"
 #include "ak8975a.h"
+#include "app_gpiote.h"
+#include "nrf_soc.h"
+#include "nrf_gpio.h"
+#include "boards.h"
+#include "printf.h"
+
+#define APP_GPIOTE_MAX_USERS            1   // MPU data ready
+
+// Boot timeline: the time at the end of each stage, printed once the device advertises. The
+// high resolution timer only starts after the BLE stack init, the stages are timed from there.
+#define BOOT_STAGES_MAX 12
+
+static struct {
+    const char *stage;
+    uint32_t time;  // us
+} boot_trace[BOOT_STAGES_MAX];
+static uint8_t boot_stages = 0;
+
+static void boot_stamp(const char *stage)
+{
+    if (boot_stages < BOOT_STAGES_MAX) {
+        boot_trace[boot_stages].stage = stage;
+        boot_trace[boot_stages].time = get_time();
+        boot_stages++;
+    }
+}
+
+static void boot_trace_print(void)
+{
+    uint32_t last = 0;
+
+    printf("Boot timeline (us, stage duration):\r\n");
+    for (int i = 0; i < boot_stages; i++) {
+        printf("%8lu %8lu %s\r\n", (unsigned long)boot_trace[i].time,
+               (unsigned long)(boot_trace[i].time - last), boot_trace[i].stage);
+        last = boot_trace[i].time;
+    }
+}
+
+// Calibration window: wait for 1 second for a 'c' on the serial port or a button press.
+// If we get a 'c', then start calibration procedure.
+// With FAST_BOOT, there is no window: the button has to be held at reset.
+static void calibration_window(void)
+{
+#ifdef FAST_BOOT
+    if (nrf_gpio_pin_read(BUTTON)) {
+        led_on(LED_R);
+        printf("Starting calibration procedure\r\n");
+        imu_calibrate(true);
+        led_off(LED_R);
+    }
+#else
+    led_on(LED_G);
+    printf("Press button or 'c' key to start calibration procedure\r\n");
+    static char c;
+    for (int i=0; i<1000; i++) {
+        bool button_was_pressed = nrf_gpio_pin_read(BUTTON);
+        if (getchar_timeout(1, &c) || button_was_pressed)
+            if(c == 'c' || button_was_pressed) {
+                led_off(LED_G);
+                led_on(LED_R);
+                printf("Starting calibration procedure\r\n");
+                printf("Please close minicom and start python calibration GUI\r\n");
+                imu_calibrate(button_was_pressed);
+                led_off(LED_R);
+                break;
+            }
+    }
+    led_off(LED_G);
+#endif
+}
 
 /**@brief Function for application main entry.
  */
@@ -21,48 +92,42 @@ int main(void)
     ble_stack_init();
     low_res_timer_init();
     high_res_timer_init();
+    boot_stamp("BLE stack and timers");
     uart_init();
+    boot_stamp("UART");
+    APP_GPIOTE_INIT(APP_GPIOTE_MAX_USERS);
     imu_init();
+    boot_stamp("IMU");
     APP_ERROR_CHECK(pstorage_init());
     calibration_store_init();
+    boot_stamp("flash storage");
 
     // Setup BLE stack
     advertising_init();
     conn_params_init();
     sec_params_init();
     gap_params_init();
+    boot_stamp("BLE setup");
 
     // Start execution
     low_res_timer_start();
     advertising_start();
+    boot_stamp("advertising");
 
     // Try load calibration data from flash
     imu_load_calibration_data();
+    boot_stamp("calibration data");
 
-    led_on(LED_G);
-    // Wait for 1 second for a 'c' on the serial port or a button press.
-    // If we get a 'c', then start calibration procedure
-    printf("Press button or 'c' key to start calibration procedure\r\n");
-    static char c;
-    for (int i=0; i<1000; i++) {
-        bool button_was_pressed = nrf_gpio_pin_read(BUTTON);
-        if (getchar_timeout(1, &c) || button_was_pressed)
-            if(c == 'c' || button_was_pressed) {
-                led_off(LED_G);
-                led_on(LED_R);
-                printf("Starting calibration procedure\r\n");
-                printf("Please close minicom and start python calibration GUI\r\n");
-                imu_calibrate(button_was_pressed);
-                led_off(LED_R);
-                break;
-            }
-    }
-    led_off(LED_G);
+    calibration_window();
+    boot_stamp("calibration window");
+    boot_trace_print();
 
     // Enter main loop
     for (;;)
     {
         imu_update();
+        // Sleep until the next interrupt: MPU data ready, timers or radio
+        APP_ERROR_CHECK(sd_app_evt_wait());
     }
 }
 
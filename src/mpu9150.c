@@ -5,6 +5,7 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 #include <math.h>
 #include <limits.h>
 
@@ -14,7 +15,15 @@
 #include "printf.h"
 #include "nordic_common.h"
 #include "app_error.h"
+#include "app_gpiote.h"
+#include "nrf_gpio.h"
+#include "boards.h"
 #include "imu.h"
+#include "fast_math.h"
+#include "high_res_timer.h"
+#include "i2c_async.h"
+#include "nrf_soc.h"
+#include "app_util.h"
 
 // Define registers per MPU6050, Register Map and Descriptions, Rev 4.2, 08/19/2013 6 DOF Motion sensor fusion device
 // Invensense Inc., www.invensense.com
@@ -53,6 +62,7 @@
 #define MOT_DUR          0x20  // Duration counter threshold for motion interrupt generation, 1 kHz rate, LSB = 1 ms
 #define ZMOT_THR         0x21  // Zero-motion detection threshold bits [7:0]
 #define ZRMOT_DUR        0x22  // Duration counter threshold for zero motion interrupt generation, 16 Hz rate, LSB = 64 ms
+#define ACCEL_CONFIG2    0x1D  // MPU9250 (FF_THR on the MPU9150): accel DLPF bits [2:0]
 #define FIFO_EN          0x23
 #define I2C_MST_CTRL     0x24
 #define I2C_SLV0_ADDR    0x25
@@ -139,6 +149,27 @@
 // On the TWI, ADO is set to 0
 #define MPU9150_ADDRESS 0x68
 
+// MPU9250 self test trims, at other addresses than the MPU9150 ones (SELF_TEST_X..A)
+#define SELF_TEST_X_GYRO_MPU9250  0x00
+#define SELF_TEST_X_ACCEL_MPU9250 0x0D
+
+// Supported parts. The MPU9250 has the same register map for everything used here, but it
+// adds an accel DLPF, has a smaller FIFO and another temperature sensor scale.
+typedef struct {
+    const char *name;
+    uint8_t whoami;
+    bool accel_dlpf;        // ACCEL_CONFIG2 present
+    uint16_t fifo_size;     // bytes
+    int16_t temp_sens;      // TEMP_OUT LSB per deg C
+    int16_t temp_zero;      // deg C at TEMP_OUT 0
+} mpu_part_t;
+
+static const mpu_part_t mpu9150_part = {"MPU9150", 0x68, false, 1024, 340, 35};
+static const mpu_part_t mpu9250_part = {"MPU9250", 0x71, true, 512, 334, 21};
+
+// Selected by the probe
+static const mpu_part_t *part = &mpu9150_part;
+
 // Set initial input parameters
 #define AFS_2G  0
 #define AFS_4G  1
@@ -150,25 +181,477 @@
 #define  GFS_1000DPS 2
 #define  GFS_2000DPS 3
 
+// Output configuration, see mpu9150_set_config()
 static uint8_t Ascale = AFS_2G;     // AFS_2G, AFS_4G, AFS_8G, AFS_16G
 static uint8_t Gscale = GFS_250DPS; // GFS_250DPS, GFS_500DPS, GFS_1000DPS, GFS_2000DPS
+static uint8_t dlpf_cfg = 1;        // DLPF_CFG, 1 to 6: 188, 98, 42, 20, 10 or 5 Hz gyro bandwidth
+static uint8_t sample_rate_div = 4; // from the 1 kHz gyro output rate (DLPF enabled): 200 Hz
+
+// The samples stay integer through the range scaling and the bias removal, in Q4 LSB at 2 g
+// for the accel (the unit of the accel biases and of the advertised accel) and at 250 deg/s
+// for the gyro (the unit of the gyro biases). They only become floats for the fusion.
+#define BIAS_FRAC_BITS 4
+
+// Scale factors derived from the configuration, raw values to Q4 LSB at 2 g and 250 deg/s
+static int32_t accel_scale = 1L << BIAS_FRAC_BITS;
+static int32_t gyro_scale = 1L << BIAS_FRAC_BITS;
+
+// Biases derived from cal by mpu9150_apply_calibration(), in Q4 LSB
+static int32_t accel_bias_q[3];
+static int32_t gyro_bias_q[3];
+
+#define GYRO_Q4_TO_RAD ((float)(250.0 * M_PI / 180.0 / 32768.0 / (1L << BIAS_FRAC_BITS)))
+
+// Raw sample: accel x, y, z, temperature, gyro x, y, z
+#define RAW_SAMPLE       7
+#define RAW_TEMP         3
+#define RAW_GYRO         4
+
+#ifdef FAST_BOOT
+// Fast boot: no fixed delays, the registers are polled until the part is back from its reset,
+// and the samples of the gyro start-up time are dropped (see mpu9150_warming_up())
+#define MPU_RESET_TIMEOUT 200000UL  // us
+#define MPU_WARMUP_TIME   50000UL   // us, gyro start-up time
+
+static uint32_t started_at;
+static bool warming_up = false;
+#endif
+
+// Poll reg until the mask bits are clear. The part may not answer meanwhile (reset). False if
+// they are still set, or it still does not answer, after timeout us.
+static bool mpu9150_wait_clear(uint8_t reg, uint8_t mask, uint32_t timeout)
+{
+    uint32_t start = get_time();
+    uint8_t value;
+
+    do {
+        if (i2c_read_byte(MPU9150_ADDRESS, reg, &value) == 0 && (value & mask) == 0)
+            return true;
+    } while (get_time() - start < timeout);
+    return false;
+}
+
+// Reset and sensors path reset durations are not documented, much less than this
+#define MPU_CLEAR_TIMEOUT 100000UL  // us
 
 void mpu9150_reset() {
     // Write a one to bit 7 reset bit; toggle reset device
     i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_1, 0x80);
-    while(i2c_read_byte(MPU9150_ADDRESS, PWR_MGMT_1) & 0x80) ;
+    if (!mpu9150_wait_clear(PWR_MGMT_1, 0x80, MPU_CLEAR_TIMEOUT))
+        printf("ERROR : %s reset timeout\n\r", part->name);
+#ifdef FAST_BOOT
+    // Ready once it answers its WHO_AM_I again (a NACK or garbage while it reloads)
+    uint32_t start = get_time();
+    uint8_t whoami;
+    while ((i2c_read_bytes(MPU9150_ADDRESS, WHO_AM_I_MPU9150, 1, &whoami) != 0 || whoami != part->whoami)
+           && get_time() - start < MPU_RESET_TIMEOUT) ;
+#else
     nrf_delay_ms(200);
+#endif
+}
+
+#if !defined(MPU9150_FIFO) && !defined(MPU9150_DMP)
+// One sample per interrupt: the data ready interrupt queues the burst read itself (see
+// i2c_async.h), the sample is already in RAM when the main loop asks for it
+#define MPU9150_ASYNC_READ
+#elif defined MPU9150_PPI_SAMPLING
+#error "MPU9150_PPI_SAMPLING reads the samples one by one, without the FIFO nor the DMP"
+#endif
+
+// Room for all the EXT_SENS_DATA registers
+#define EXT_SENS_MAX     24
+
+// Set by the data ready interrupt (or the end of the sample read), cleared by
+// mpu9150_new_data()
+static volatile bool data_ready = false;
+// Samples signalled since the last FIFO count read (a pulse may be missed, this is only a
+// hint to check the count early, the count decides)
+static volatile uint8_t fifo_pending = 0;
+
+#ifdef MPU9150_ASYNC_READ
+// Sample read, double buffered: the interrupt fills one buffer while the other one holds the
+// last complete sample
+static void sample_read_done(i2c_transaction_t *t, bool success);
+
+static i2c_transaction_t sample_read = {
+    .address  = MPU9150_ADDRESS,
+    .reg      = ACCEL_XOUT_H,
+    .read     = true,
+    .callback = sample_read_done,
+};
+static uint8_t sample_buf[2][14 + EXT_SENS_MAX];
+static volatile uint8_t sample_last = 0;
+static volatile uint8_t sample_last_len = 0;
+static volatile bool sample_buffered = false;   // sample_buf[sample_last] not read yet
+// External sensor bytes read along, as last asked by mpu9150_read_data_ext(), from the next
+// read
+static volatile uint8_t sample_ext_len = 0;
+// Samples read since the last mpu9150_read_sample(), and by it
+static volatile uint8_t sample_count = 0;
+static uint8_t samples_read = 0;
+
+// Any interrupt priority
+static void sample_submit(void)
+{
+    if (sample_read.status == I2C_QUEUED)
+        return;     // the pending read gets this sample
+    sample_read.data   = sample_buf[sample_last ^ 1];
+    sample_read.length = 14 + sample_ext_len;
+    i2c_async_submit(&sample_read);
+}
+
+// TWI interrupt. A failed read leaves the pin high, mpu9150_new_data() queues it again.
+static void sample_read_done(i2c_transaction_t *t, bool success)
+{
+    if (!success)
+        return;
+    sample_last ^= 1;
+    sample_last_len = t->length;
+    sample_buffered = true;
+    if (sample_count < UINT8_MAX)
+        sample_count++;
+    data_ready = true;
+
+    // With MPU9150_PPI_SAMPLING, the next read starts on its own
+    t->data   = sample_buf[sample_last ^ 1];
+    t->length = 14 + sample_ext_len;
+}
+#endif
+
+#ifndef MPU9150_PPI_SAMPLING
+static void data_ready_handler(uint32_t event_pins_low_to_high, uint32_t event_pins_high_to_low)
+{
+#ifdef MPU9150_ASYNC_READ
+    sample_submit();
+#else
+    data_ready = true;
+#endif
+    if (fifo_pending < UINT8_MAX)
+        fifo_pending++;
+}
+#endif
+
+// FIFO frames: accel, temperature and gyro, big endian
+#define FIFO_FRAME       14
+#define FIFO_READ_MAX    16    // frames per burst, i2c_read_bytes() reads up to 255 bytes
+
+static uint32_t fifo_overflows = 0;
+
+// USER_CTRL bits
+#define USER_CTRL_FIFO_EN     0x40
+#define USER_CTRL_I2C_MST_EN  0x20
+#define USER_CTRL_FIFO_RESET  0x04
+
+// INT_PIN_CFG bit letting the nRF reach the compass directly
+#define INT_PIN_CFG_BYPASS_EN 0x02
+
+// USER_CTRL and INT_PIN_CFG as last written, so that the FIFO and the auxiliary I2C master
+// settings do not undo each other
+static uint8_t user_ctrl = 0;
+static uint8_t int_pin_cfg = 0;
+
+static void mpu9150_fifo_reset(void)
+{
+    // Disable, reset, then enable again the FIFO, leaving the I2C master alone
+    user_ctrl &= ~USER_CTRL_FIFO_EN;
+    i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, user_ctrl);
+    i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, user_ctrl | USER_CTRL_FIFO_RESET);
+    user_ctrl |= USER_CTRL_FIFO_EN;
+    i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, user_ctrl);
+    fifo_pending = 0;
+}
+
+#ifdef FAST_BOOT
+// True during the gyro start-up time after mpu9150_init(): the samples are not valid yet
+static bool mpu9150_warming_up(void)
+{
+    if (warming_up && get_time() - started_at < MPU_WARMUP_TIME)
+        return true;
+    warming_up = false;
+    return false;
+}
+#endif
+
+// Route the MPU INT pin to a GPIOTE user, so that the main loop no longer polls INT_STATUS
+// over I2C. The pin is latched: it goes high with each new sample and back low when the
+// sample is read. mpu9150_init() runs again after the bias measure: register only once.
+static void mpu9150_int_init(void)
+{
+#ifdef MPU9150_PPI_SAMPLING
+    // The pin starts the sample reads itself, through PPI: the CPU only sees the end of each
+    // read, the reads are timed by the MPU clock alone. A sample already pending is read
+    // right away.
+    static bool triggered = false;
+
+    if (!triggered) {
+        nrf_gpio_cfg_input(I2C_INT, NRF_GPIO_PIN_NOPULL);   // push-pull output on the MPU side
+        sample_read.data   = sample_buf[sample_last ^ 1];
+        sample_read.length = 14 + sample_ext_len;
+        APP_ERROR_CHECK_BOOL(i2c_async_set_trigger(&sample_read, I2C_INT));
+        triggered = true;
+    }
+#else
+    static app_gpiote_user_id_t gpiote_user;
+    static bool registered = false;
+
+    if (!registered) {
+        nrf_gpio_cfg_input(I2C_INT, NRF_GPIO_PIN_NOPULL);   // push-pull output on the MPU side
+        APP_ERROR_CHECK(app_gpiote_user_register(&gpiote_user, 1 << I2C_INT, 0, data_ready_handler));
+        registered = true;
+    }
+    APP_ERROR_CHECK(app_gpiote_user_enable(gpiote_user));
+
+    // The sensing starts from the current level: a sample that was already pending would
+    // never give a rising edge
+    if (nrf_gpio_pin_read(I2C_INT)) {
+#ifdef MPU9150_ASYNC_READ
+        CRITICAL_REGION_ENTER();
+        sample_submit();
+        CRITICAL_REGION_EXIT();
+#else
+        data_ready = true;
+#endif
+    }
+#endif
+}
+
+
+// Disable FSYNC, set the DLPF (which sets the gyro output rate at 1 kHz), the sample rate
+// (gyro output rate / (1 + SMPLRT_DIV)) and the full scale ranges, then derive the scale factors
+static void mpu9150_write_config(void)
+{
+    i2c_write_byte(MPU9150_ADDRESS, CONFIG, dlpf_cfg);
+    i2c_write_byte(MPU9150_ADDRESS, SMPLRT_DIV, sample_rate_div);
+    // Range selects FS_SEL and AFS_SEL are 0 - 3, so 2-bit values are left-shifted into
+    // positions 4:3. Self-test bits [7:5] are cleared.
+    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, Gscale << 3);
+    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, Ascale << 3);
+    // The MPU9250 accel DLPF settings give about the same bandwidths as the gyro ones
+    if (part->accel_dlpf)
+        i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG2, dlpf_cfg);
+
+    // Each range step doubles the LSB
+    accel_scale = 1L << (Ascale + BIAS_FRAC_BITS);
+    gyro_scale = 1L << (Gscale + BIAS_FRAC_BITS);
+}
+
+// Gyro bias temperature compensation. The gyro bias (LSB at 250 deg/s) is learnt per
+// temperature bin in cal.gyro_temp_bias: at the bias measure (which restarts the model from
+// that single bin), and whenever the device stands still for a whole STILL_SAMPLES window.
+// The applied bias is interpolated between the learnt bins around the current temperature
+// (the nearest learnt one outside of them), or is cal.gyro_bias while no bin is learnt. It is
+// only computed again when the temperature moves.
+// Temperatures are raw TEMP_OUT values: T (deg C) = raw / temp_sens + temp_zero.
+#define TEMP_RAW(deg)     (((deg) - part->temp_zero) * part->temp_sens)
+#define TEMP_BIN_FIRST    TEMP_RAW(18)              // center of bin 0
+#define TEMP_BIN_WIDTH    (4 * part->temp_sens)     // 4 deg C
+#define TEMP_HYSTERESIS   (part->temp_sens / 10)    // 0.1 deg C
+
+#define STILL_SAMPLES     200               // 1 s at 200 Hz
+#define STILL_GYRO        65                // max gyro swing, LSB at 250 deg/s (0.5 deg/s)
+#define STILL_ACCEL       330               // max accel swing, LSB at 2 g (20 mg)
+#define STILL_BIAS_MAX    262               // max distance to cal.gyro_bias (2 deg/s), more is motion
+#define STILL_LEARN_SHIFT 3                 // a still window moves a learnt bin by 1/8
+
+static int16_t bias_temp = INT16_MIN / 2;   // temperature of the applied bias, far from any
+static volatile bool temp_bin_learnt = false;
+
+static void gyro_temp_compensate(int16_t temp)
+{
+    uint32_t valid = cal.gyro_temp_valid;
+    float pos = (float)(temp - TEMP_BIN_FIRST) / TEMP_BIN_WIDTH;
+    int lo = -1, hi = -1;
+    float bias[3];
+
+    bias_temp = temp;
+
+    // Nearest learnt bins below and above the temperature
+    for (int n = 0; n < GYRO_TEMP_BINS; n++) {
+        if (!(valid & (1UL << n)))
+            continue;
+        if (n <= pos)
+            lo = n;
+        else if (hi < 0)
+            hi = n;
+    }
+
+    for (int i = 0; i < 3; i++) {
+        if (lo >= 0 && hi >= 0)
+            bias[i] = cal.gyro_temp_bias[lo][i] + (cal.gyro_temp_bias[hi][i] - cal.gyro_temp_bias[lo][i]) * (pos - lo) / (hi - lo);
+        else if (lo >= 0)
+            bias[i] = cal.gyro_temp_bias[lo][i];
+        else if (hi >= 0)
+            bias[i] = cal.gyro_temp_bias[hi][i];
+        else
+            bias[i] = cal.gyro_bias[i];
+        gyro_bias_q[i] = float_to_fixed(bias[i], BIAS_FRAC_BITS);
+    }
+}
+
+// Learn the bias of the bin of temp: the first value is taken as is, the next ones are
+// low-passed
+static void gyro_temp_store(int16_t temp, const float *bias)
+{
+    int n = (temp - TEMP_BIN_FIRST + TEMP_BIN_WIDTH / 2) / TEMP_BIN_WIDTH;
+    if (temp < TEMP_BIN_FIRST - TEMP_BIN_WIDTH / 2)
+        n = 0;
+    if (n >= GYRO_TEMP_BINS)
+        n = GYRO_TEMP_BINS - 1;
+
+    for (int i = 0; i < 3; i++) {
+        if (cal.gyro_temp_valid & (1UL << n))
+            cal.gyro_temp_bias[n][i] += (bias[i] - cal.gyro_temp_bias[n][i]) / (1 << STILL_LEARN_SHIFT);
+        else
+            cal.gyro_temp_bias[n][i] = bias[i];
+    }
+    if (!(cal.gyro_temp_valid & (1UL << n))) {
+        cal.gyro_temp_valid |= 1UL << n;
+        temp_bin_learnt = true;
+    }
+
+    // Apply at once
+    gyro_temp_compensate(temp);
+}
+
+// Stillness detection over windows of STILL_SAMPLES raw samples: all the accel and gyro
+// swings small enough, and the mean gyro close to the calibrated bias (a slow constant
+// rotation has no swing). Integer only, a few compares per sample.
+static void gyro_temp_learn(const int16_t *data)
+{
+    static int16_t min[6], max[6];
+    static int32_t sum[3], temp_sum;
+    static uint16_t count = 0;
+    int16_t v;
+    bool still = true;
+
+    for (int i = 0; i < 6; i++) {
+        v = data[i < 3 ? i : RAW_GYRO + i - 3];
+        if (count == 0 || v < min[i])
+            min[i] = v;
+        if (count == 0 || v > max[i])
+            max[i] = v;
+    }
+    if (count == 0)
+        sum[0] = sum[1] = sum[2] = temp_sum = 0;
+    for (int i = 0; i < 3; i++)
+        sum[i] += data[RAW_GYRO + i];
+    temp_sum += data[RAW_TEMP];
+
+    if (++count < STILL_SAMPLES)
+        return;
+    count = 0;
+
+    // Swings in raw LSB at the configured ranges
+    for (int i = 0; i < 3; i++) {
+        if (max[i] - min[i] > (STILL_ACCEL >> Ascale))
+            still = false;
+        if (max[i + 3] - min[i + 3] > (STILL_GYRO >> Gscale))
+            still = false;
+    }
+    if (!still)
+        return;
+
+    float bias[3];
+    for (int i = 0; i < 3; i++) {
+        bias[i] = (float)sum[i] * (1 << Gscale) / STILL_SAMPLES;
+        if (bias[i] - cal.gyro_bias[i] > STILL_BIAS_MAX || cal.gyro_bias[i] - bias[i] > STILL_BIAS_MAX)
+            return;
+    }
+    gyro_temp_store(temp_sum / STILL_SAMPLES, bias);
+}
+
+// Return true once after a temperature bin was learnt for the first time, for the caller to
+// store the calibration data (a bounded number of flash writes)
+bool mpu9150_gyro_temp_learnt(void)
+{
+    if (!temp_bin_learnt)
+        return false;
+    temp_bin_learnt = false;
+    return true;
+}
+
+// Derive the fixed-point biases from cal, after any change of the calibration data
+void mpu9150_apply_calibration(void)
+{
+    for (int i = 0; i < 3; i++)
+        accel_bias_q[i] = float_to_fixed(cal.accel_bias[i], BIAS_FRAC_BITS);
+    gyro_temp_compensate(bias_temp);
+}
+
+// Accel range in g (2, 4, 8, 16), gyro range in deg/s (250, 500, 1000, 2000), DLPF_CFG (1 to
+// 6) and output rate in Hz (4 to 1000, rounded to the nearest divider of 1 kHz, see
+// mpu9150_sample_period()). Returns false, changing nothing, if a value is not supported.
+bool mpu9150_set_config(uint8_t accel_g, uint16_t gyro_dps, uint8_t dlpf, uint16_t rate_hz)
+{
+    uint8_t a, g;
+
+    switch (accel_g) {
+    case 2:  a = AFS_2G;  break;
+    case 4:  a = AFS_4G;  break;
+    case 8:  a = AFS_8G;  break;
+    case 16: a = AFS_16G; break;
+    default: return false;
+    }
+    switch (gyro_dps) {
+    case 250:  g = GFS_250DPS;  break;
+    case 500:  g = GFS_500DPS;  break;
+    case 1000: g = GFS_1000DPS; break;
+    case 2000: g = GFS_2000DPS; break;
+    default: return false;
+    }
+    if (dlpf < 1 || dlpf > 6 || rate_hz < 4 || rate_hz > 1000)
+        return false;
+
+    Ascale = a;
+    Gscale = g;
+    dlpf_cfg = dlpf;
+    sample_rate_div = (1000 + rate_hz / 2) / rate_hz - 1;
+    mpu9150_write_config();
+
+#ifdef MPU9150_FIFO
+    // Drop the frames taken with the previous ranges
+    mpu9150_fifo_reset();
+#endif
+    return true;
+}
+
+// Select the part if it answers
+static bool mpu_probe(const mpu_part_t *p)
+{
+    uint8_t whoami;
+
+    if (i2c_read_bytes(MPU9150_ADDRESS, WHO_AM_I_MPU9150, 1, &whoami) != 0 || whoami != p->whoami)
+        return false;
+    part = p;
+    return true;
+}
+
+bool mpu9150_probe(void)
+{
+    return mpu_probe(&mpu9150_part);
+}
+
+bool mpu9250_probe(void)
+{
+    return mpu_probe(&mpu9250_part);
 }
 
 void mpu9150_init()
 {
-    uint8_t whoami = i2c_read_byte(MPU9150_ADDRESS, WHO_AM_I_MPU9150);
-    if (whoami != 0x68) {
-        // WHO_AM_I should be 0x68
-        printf("ERROR : I SHOULD BE 0x68\n\r");
+    uint8_t whoami = 0;
+    if (i2c_read_byte(MPU9150_ADDRESS, WHO_AM_I_MPU9150, &whoami) != 0 || whoami != part->whoami) {
+        printf("ERROR : %s SHOULD BE 0x%x\n\r", part->name, part->whoami);
         APP_ERROR_CHECK_BOOL(false);
     }
 
+#ifdef FAST_BOOT
+    // Take MPU9150 out of sleep, directly on the PLL clock: it runs on the internal oscillator
+    // until the gyro is up, the configuration goes on meanwhile
+    i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_1, 0x01);
+    i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_2, 0x00);
+    started_at = get_time();
+    warming_up = true;
+#else
     // Take MPU9150 out of sleep
     i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_1, 0x00);
     // Delay 100ms for gyro startup
@@ -178,55 +661,52 @@ void mpu9150_init()
     i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_1, 0x01);
     i2c_write_byte(MPU9150_ADDRESS, PWR_MGMT_2, 0x00);
     nrf_delay_ms(100);
+#endif
 
     // Disable I2C master mode, disable FIFO
     i2c_write_byte(MPU9150_ADDRESS, I2C_MST_CTRL, 0x00);
     i2c_write_byte(MPU9150_ADDRESS, FIFO_EN, 0x00);
     // Reset sensors PATH and registers and FIFO
     i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, 0x5);
-    while(i2c_read_byte(MPU9150_ADDRESS, USER_CTRL) & 0x05) ;
-
-    // Configure Gyro and Accelerometer
-    // Disable FSYNC and set accelerometer and gyro bandwidth to 44 and 42 Hz, respectively;
-    // DLPF_CFG = bits 2:0 = 010; this sets the sample rate at 1 kHz for both
-    // Maximum delay is 4.9 ms which is just over a 200 Hz maximum rate
-    i2c_write_byte(MPU9150_ADDRESS, CONFIG, 0x01); // XXXX FIXME : 0x03
-
-    // Set sample rate = gyroscope output rate/(1 + SMPLRT_DIV)
-    i2c_write_byte(MPU9150_ADDRESS, SMPLRT_DIV, 0x04);  // Use a 200 Hz rate; the same rate set in CONFIG above
-
-    // Set gyroscope full scale range
-    // Range selects FS_SEL and AFS_SEL are 0 - 3, so 2-bit values are left-shifted into positions 4:3
-    uint8_t c =  i2c_read_byte(MPU9150_ADDRESS, GYRO_CONFIG);
-    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, c & ~0xE0); // Clear self-test bits [7:5]
-    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, c & ~0x18); // Clear AFS bits [4:3]
-    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, c | Gscale << 3); // Set full scale range for the gyro
+    if (!mpu9150_wait_clear(USER_CTRL, 0x05, MPU_CLEAR_TIMEOUT))
+        printf("ERROR : %s sensors reset timeout\n\r", part->name);
+    user_ctrl = 0;
 
-    // Set accelerometer configuration
-    c =  i2c_read_byte(MPU9150_ADDRESS, ACCEL_CONFIG);
-    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, c & ~0xE0); // Clear self-test bits [7:5]
-    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, c & ~0x18); // Clear AFS bits [4:3]
-    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, c | Ascale << 3); // Set full scale range for the accelerometer
-
-    // The accelerometer, gyro, and thermometer are set to 1 kHz sample rates,
-    // but all these rates are further reduced by a factor of 5 to 200 Hz because of the SMPLRT_DIV setting
+    // Configure Gyro and Accelerometer: bandwidth, sample rate and full scale ranges
+    mpu9150_write_config();
 
     // Configure Interrupts and Bypass Enable
-    // Set interrupt pin active high, push-pull, latched and clear on read of INT_STATUS,
+    // Set interrupt pin active high, push-pull, latched and cleared by any read (INT_RD_CLEAR),
+    // so that the data burst read releases it without an extra read of INT_STATUS.
     // Enable I2C_BYPASS_EN so magnetometer can join the I2C bus and can be controlled
     // by the TWI as master
-    i2c_write_byte(MPU9150_ADDRESS, INT_PIN_CFG, 0x22);
+#ifdef MPU9150_FIFO
+    // In FIFO mode the samples are not read one by one, so nothing would release a latched
+    // pin: use 50 us pulses instead, only counted to check the FIFO count early
+    int_pin_cfg = 0x12;
+#else
+    int_pin_cfg = 0x32;
+#endif
+    i2c_write_byte(MPU9150_ADDRESS, INT_PIN_CFG, int_pin_cfg);
     i2c_write_byte(MPU9150_ADDRESS, INT_ENABLE, 0x01);  // Enable data ready (bit 0) interrupt
+
+#ifdef MPU9150_FIFO
+    // Push accel, temperature and gyro (14 bytes per sample) into the FIFO
+    i2c_write_byte(MPU9150_ADDRESS, FIFO_EN, 0xF8);
+    mpu9150_fifo_reset();
+#endif
+
+    mpu9150_int_init();
 }
 
 
-// Read accel and gyro raw values.
-static void mpu9150_read_raw_data(int16_t * values)
+// Split a burst read from ACCEL_XOUT_H: accel, temperature and gyro raw values (RAW_SAMPLE
+// values, in the register order), and ext_len bytes of external sensor data (copied from the
+// auxiliary I2C slaves) into ext.
+static void mpu9150_parse_raw_data(const uint8_t *data, int16_t * values, uint8_t *ext, uint8_t ext_len)
 {
-    static uint8_t data[14];
-
-    // Burst read all sensors to ensure the same timestamp for everybody
-    i2c_read_bytes(MPU9150_ADDRESS, ACCEL_XOUT_H, 14, data);
+    for (int i = 0; i < ext_len; i++)
+        ext[i] = data[14 + i];
 
 #if 0
     for (int j=0; j<14; j++)
@@ -234,61 +714,282 @@ static void mpu9150_read_raw_data(int16_t * values)
     printf("\r\n");
 #endif
 
-    // Convert each 2 byte into signed 16bit values
-    // WARNING : code valid in little endian only !
-    uint8_t *p;
-    for(int i=0; i<3; i++) {
-        p = ((uint8_t*)&values[i])+1;
-        *p = data[2*i];
-        p = (uint8_t*)&values[i];
-        *p = data[2*i+1];
-    }
-    for(int i=3; i<6; i++) {
-        p = ((uint8_t*)&values[i])+1;
-        *p = data[2*i+2];
-        p = (uint8_t*)&values[i];
-        *p = data[2*i+3];
-    }
+    // Convert each 2 byte (big endian) into signed 16bit values
+    for(int i=0; i<RAW_SAMPLE; i++)
+        values[i] = (int16_t)((data[2*i] << 8) | data[2*i+1]);
 
 #if 0
-    for (int j=0; j<6; j++)
+    for (int j=0; j<RAW_SAMPLE; j++)
         printf("0x%04x ", (int16_t) values[j]);
     printf("\r\n");
 #endif
 }
 
+// Blocking read of the current sample, see mpu9150_parse_raw_data()
+static void mpu9150_read_raw_data(int16_t * values, uint8_t *ext, uint8_t ext_len)
+{
+    static uint8_t data[14 + EXT_SENS_MAX];
+
+    if (ext_len > EXT_SENS_MAX)
+        ext_len = EXT_SENS_MAX;
+
+    // Burst read all sensors to ensure the same timestamp for everybody. EXT_SENS_DATA_00
+    // comes right after GYRO_ZOUT_L, so the external data is part of the same burst.
+    i2c_read_bytes(MPU9150_ADDRESS, ACCEL_XOUT_H, 14 + ext_len, data);
+    mpu9150_parse_raw_data(data, values, ext, ext_len);
+}
+
+// Latest sample: the one the interrupt read if it is still unused, else a blocking read
+static void mpu9150_read_sample(int16_t * values, uint8_t *ext, uint8_t ext_len)
+{
+#ifdef MPU9150_ASYNC_READ
+    bool buffered = false;
+
+    if (ext_len > EXT_SENS_MAX)
+        ext_len = EXT_SENS_MAX;
+
+    CRITICAL_REGION_ENTER();
+    if (sample_buffered && 14 + ext_len <= sample_last_len) {
+        mpu9150_parse_raw_data(sample_buf[sample_last], values, ext, ext_len);
+        sample_buffered = false;
+        buffered = true;
+    }
+    samples_read = buffered ? sample_count : 0;
+    sample_count = 0;
+    CRITICAL_REGION_EXIT();
+    if (buffered)
+        return;
+
+    // Read the external data along from now on
+    if (ext_len > sample_ext_len)
+        sample_ext_len = ext_len;
+#endif
+    mpu9150_read_raw_data(values, ext, ext_len);
+}
+
+// Scale and correct raw accel values, in LSB at 2 g
+void mpu9150_convert_accel(const int16_t *data, float *values)
+{
+    // XXX FIXME : WARNING, accel axis seems to be inconsistent with the datasheet (all signs are reversed)
+    // Hence, the "-...." on the accel values
+    for(int i=0; i<3; i++)
+        values[i] = (float)(-data[i] * accel_scale - accel_bias_q[i]) * (1.0f / (1L << BIAS_FRAC_BITS));
+}
+
+// Scale and correct a raw sample: accel in LSB at 2 g, gyro in rad/s
+static void mpu9150_convert(const int16_t *data, float *values)
+{
+    gyro_temp_learn(data);
+    if (data[RAW_TEMP] - bias_temp > TEMP_HYSTERESIS || bias_temp - data[RAW_TEMP] > TEMP_HYSTERESIS)
+        gyro_temp_compensate(data[RAW_TEMP]);
+
+    mpu9150_convert_accel(data, values);
+    for(int i=0; i<3; i++)
+        values[i+3] = (float)(data[RAW_GYRO + i] * gyro_scale - gyro_bias_q[i]) * GYRO_Q4_TO_RAD;
+}
+
 // Read accel, temps and gyro raw values.
 void mpu9150_read_data(float * values)
 {
-    int16_t data[6];
+    int16_t data[RAW_SAMPLE];
 
     // Read raw data
-    mpu9150_read_raw_data(data);
+    mpu9150_read_sample(data, NULL, 0);
 #if 0
-    printf("raw = %d %d %d %d %d %d\r\n",
+    printf("raw = %d %d %d %d %d %d %d\r\n",
            (int)data[0], (int)data[1], (int)data[2],
-           data[3], data[4], data[5]);
+           data[3], data[4], data[5], data[6]);
 #endif
 
-    // XXX FIXME : WARNING, accel axis seems to be inconsistent with the datasheet (all signs are reversed)
-    // Hence, the "-...." on the accel values
-    for(int i=0; i<3; i++)
-        data[i] = -data[i];
+    mpu9150_convert(data, values);
+}
+
+// Same as mpu9150_read_data(), also returning ext_len bytes of external sensor data
+void mpu9150_read_data_ext(float * values, uint8_t *ext, uint8_t ext_len)
+{
+    int16_t data[RAW_SAMPLE];
+
+    mpu9150_read_sample(data, ext, ext_len);
+    mpu9150_convert(data, values);
+}
+
+// Only read the external sensor data
+void mpu9150_read_ext(uint8_t *ext, uint8_t ext_len)
+{
+    if (ext_len > EXT_SENS_MAX)
+        ext_len = EXT_SENS_MAX;
+    i2c_read_bytes(MPU9150_ADDRESS, EXT_SENS_DATA_00, ext_len, ext);
+}
+
+// Auxiliary I2C master. Each sample, the MPU runs the enabled slaves in order (slave 0
+// first), so that one slave can read the result of a measure that the next one triggers.
+// The read data lands in EXT_SENS_DATA_00 and up, in slave order.
+
+// Slave registers are 3 apart, starting at I2C_SLV0_ADDR
+#define I2C_SLV_ADDR(n)  (I2C_SLV0_ADDR + 3 * (n))
+#define I2C_SLV_REG(n)   (I2C_SLV0_REG + 3 * (n))
+#define I2C_SLV_CTRL(n)  (I2C_SLV0_CTRL + 3 * (n))
+#define I2C_SLV_DO(n)    (I2C_SLV0_DO + (n))
+
+#define I2C_SLV_RW       0x80  // in I2C_SLVx_ADDR, read
+#define I2C_SLV_EN       0x80  // in I2C_SLVx_CTRL
+
+// Have slave n (0 to 3) read len bytes from register reg of the device at addr
+void mpu9150_aux_read_setup(uint8_t slave, uint8_t addr, uint8_t reg, uint8_t len)
+{
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_ADDR(slave), I2C_SLV_RW | addr);
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_REG(slave), reg);
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_CTRL(slave), I2C_SLV_EN | (len & 0x0F));
+}
+
+// Have slave n (0 to 3) write value into register reg of the device at addr
+void mpu9150_aux_write_setup(uint8_t slave, uint8_t addr, uint8_t reg, uint8_t value)
+{
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_ADDR(slave), addr);
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_REG(slave), reg);
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_DO(slave), value);
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV_CTRL(slave), I2C_SLV_EN | 1);
+}
+
+// Access the slaves set in mask (bit n for slave n) only once every 1 + div samples, for
+// devices slower than the MPU sample rate
+void mpu9150_aux_rate(uint8_t mask, uint8_t div)
+{
+    i2c_write_byte(MPU9150_ADDRESS, I2C_SLV4_CTRL, div & 0x1F);
+    // Also wait for all the slaves before shadowing the external data (bit 7), so that a
+    // read never mixes two measures
+    i2c_write_byte(MPU9150_ADDRESS, I2C_MST_DELAY_CTRL, 0x80 | (mask & 0x0F));
+}
+
+// Switch between the auxiliary I2C master (the MPU drives the slaves set up above) and the
+// bypass mode (the nRF reaches the auxiliary bus devices directly)
+void mpu9150_aux_master_enable(bool enable)
+{
+    if (enable) {
+        int_pin_cfg &= ~INT_PIN_CFG_BYPASS_EN;
+        i2c_write_byte(MPU9150_ADDRESS, INT_PIN_CFG, int_pin_cfg);
+        // 400 kHz, and delay the data ready interrupt until the external data is loaded
+        i2c_write_byte(MPU9150_ADDRESS, I2C_MST_CTRL, 0x40 | 0x0D);
+        user_ctrl |= USER_CTRL_I2C_MST_EN;
+        i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, user_ctrl);
+    }
+    else {
+        user_ctrl &= ~USER_CTRL_I2C_MST_EN;
+        i2c_write_byte(MPU9150_ADDRESS, USER_CTRL, user_ctrl);
+        i2c_write_byte(MPU9150_ADDRESS, I2C_MST_CTRL, 0x00);
+        // Let a transaction in progress on the auxiliary bus end
+        nrf_delay_ms(1);
+        int_pin_cfg |= INT_PIN_CFG_BYPASS_EN;
+        i2c_write_byte(MPU9150_ADDRESS, INT_PIN_CFG, int_pin_cfg);
+    }
+}
+
+// Time between two samples, in us
+uint32_t mpu9150_sample_period(void)
+{
+    return (1 + sample_rate_div) * 1000UL;
+}
+
+// Samples since the previous read: only known when the pin starts the reads itself, each one
+// of them is then read
+uint8_t mpu9150_samples_read(void)
+{
+#ifdef MPU9150_PPI_SAMPLING
+    return samples_read;
+#else
+    return 0;
+#endif
+}
+
+uint8_t mpu9150_fifo_pending(void)
+{
+    return fifo_pending;
+}
+
+uint32_t mpu9150_fifo_overflows(void)
+{
+    return fifo_overflows;
+}
+
+// Drain up to max samples (6 values each, as mpu9150_read_data()) from the FIFO, oldest
+// first, in one burst, if FIFO_COUNT holds at least min of them. Returns the number of
+// samples read, or -1 after an overflow: a full FIFO keeps overwriting its oldest bytes, so
+// the frames are no longer aligned, and it is reset, losing its content.
+int mpu9150_read_fifo(float *values, int min, int max)
+{
+    static uint8_t data[FIFO_READ_MAX * FIFO_FRAME];
+    uint8_t count_data[2];
+    int16_t raw[RAW_SAMPLE];
+    int count, n;
+
+#ifdef FAST_BOOT
+    if (mpu9150_warming_up()) {
+        mpu9150_fifo_reset();
+        return 0;
+    }
+#endif
+    fifo_pending = 0;
 
-    // Apply correction (bias and gain for gyroscope)
-    for(int i=0; i<3; i++) {
-        values[i] = 1.*data[i] - cal.accel_bias[i];
-        // Convert gyro in rad/s
-        values[i+3] = (data[i+3] - cal.gyro_bias[i]) * 250.0 * M_PI / 180. / 32768.0;
+    i2c_read_bytes(MPU9150_ADDRESS, FIFO_COUNTH, 2, count_data);
+    count = (count_data[0] << 8) | count_data[1];
+    if (count >= part->fifo_size) {
+        fifo_overflows++;
+        mpu9150_fifo_reset();
+        return -1;
     }
+
+    n = count / FIFO_FRAME;
+    if (n < min)
+        return 0;
+    if (n > max)
+        n = max;
+    if (n > FIFO_READ_MAX)
+        n = FIFO_READ_MAX;
+    if (n == 0)
+        return 0;
+
+    i2c_read_bytes(MPU9150_ADDRESS, FIFO_R_W, n * FIFO_FRAME, data);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < RAW_SAMPLE; j++)
+            raw[j] = (int16_t)((data[i * FIFO_FRAME + 2 * j] << 8) | data[i * FIFO_FRAME + 2 * j + 1]);
+        mpu9150_convert(raw, &values[6 * i]);
+    }
+    return n;
 }
 
 
 
-// Return true if a new measure is available
+// Return true if a new measure is available (once per data ready interrupt)
 bool mpu9150_new_data()
 {
-    return i2c_read_byte(MPU9150_ADDRESS, INT_STATUS) & 0x01;
+#ifdef MPU9150_ASYNC_READ
+    // Nobody waits for the sample reads: a stuck one would stall them all
+    i2c_async_check_timeout();
+
+    // A failed sample read leaves the pin high, there will be no more edge: read it again
+    if (!data_ready && sample_read.status != I2C_QUEUED && nrf_gpio_pin_read(I2C_INT)) {
+        CRITICAL_REGION_ENTER();
+        sample_submit();
+        CRITICAL_REGION_EXIT();
+    }
+#endif
+    if (!data_ready)
+        return false;
+    data_ready = false;
+#ifdef FAST_BOOT
+    if (mpu9150_warming_up()) {
+#ifdef MPU9150_ASYNC_READ
+        // Drop the sample, already read
+        sample_buffered = false;
+#else
+        // Drop the sample, the read releases the latched pin
+        uint8_t status;
+        i2c_read_byte(MPU9150_ADDRESS, INT_STATUS, &status);
+#endif
+        return false;
+    }
+#endif
+    return true;
 }
 
 
@@ -296,34 +997,22 @@ bool mpu9150_new_data()
 // of the at-rest readings and then store them in gyro_bias and accel_bias variables.
 void mpu9150_measure_biases()
 {
-    static float data[6]; // data array to hold accelerometer and gyro x, y, z data
-    static float gyro_bias[3] = {0, 0, 0};
-    static float accel_bias[3] = {0, 0, 0};
+    int16_t data[RAW_SAMPLE]; // raw accelerometer, temperature and gyro x, y, z data
+    int32_t gyro_bias[3] = {0, 0, 0};
+    int32_t accel_bias[3] = {0, 0, 0};
+    int32_t temp = 0;
+    uint8_t a = Ascale, g = Gscale;
 
     // Reset chip to reset HW cal register to factory trim
     mpu9150_reset();
     mpu9150_init();
 
-    // Reset calibration data
-    accel_bias[0] = 0;
-    accel_bias[1] = 0;
-    accel_bias[2] = 0;
-    gyro_bias[0] = 0;
-    gyro_bias[1] = 0;
-    gyro_bias[2] = 0;
-
-    cal.accel_bias[0] = 0;
-    cal.accel_bias[1] = 0;
-    cal.accel_bias[2] = 0;
-    cal.gyro_bias[0] = 0;
-    cal.gyro_bias[1] = 0;
-    cal.gyro_bias[2] = 0;
-
     // Configure MPU9150 gyro and accelerometer for bias calculation
-    // Set gyro full-scale to 250 degrees per second, maximum sensitivity
-    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, 0x00);
-    // Set accelerometer full-scale to 2 g, maximum sensitivity
-    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, 0x00);
+    // Set gyro full-scale to 250 degrees per second and accelerometer full-scale to 2 g,
+    // maximum sensitivity: the raw values are then directly in the units of the biases
+    Ascale = AFS_2G;
+    Gscale = GFS_250DPS;
+    mpu9150_write_config();
     nrf_delay_ms(200);
 
     // Accumulate 200 measures each 5 ms (200Hz sample rate)
@@ -333,32 +1022,34 @@ void mpu9150_measure_biases()
         nrf_delay_ms(5);
 
         // Get new measurement
-        mpu9150_read_data(data);
+        mpu9150_read_raw_data(data, NULL, 0);
 
 #if 0
         // Debug
         printf("measure biases : ");
-        for (int j=0; j<6; j=j+1)
-            printf("%f ", data[j]);
+        for (int j=0; j<RAW_SAMPLE; j=j+1)
+            printf("%d ", data[j]);
         printf("\r\n");
 #endif
 
         // Sum individual signed 16-bit biases to get accumulated signed 32-bit biases
-        accel_bias[0] += data[0];
-        accel_bias[1] += data[1];
-        accel_bias[2] += data[2];
-        gyro_bias[0]  += data[3];
-        gyro_bias[1]  += data[4];
-        gyro_bias[2]  += data[5];
+        // (accel signs reversed, as in mpu9150_convert_accel())
+        accel_bias[0] -= data[0];
+        accel_bias[1] -= data[1];
+        accel_bias[2] -= data[2];
+        gyro_bias[0]  += data[RAW_GYRO];
+        gyro_bias[1]  += data[RAW_GYRO + 1];
+        gyro_bias[2]  += data[RAW_GYRO + 2];
+        temp          += data[RAW_TEMP];
 
     }
     // Normalize sums to get average count biases
-    cal.accel_bias[0] = accel_bias[0] / meas_count;
-    cal.accel_bias[1] = accel_bias[1] / meas_count;
-    cal.accel_bias[2] = accel_bias[2] / meas_count;
-    cal.gyro_bias[0]  = gyro_bias[0] / meas_count;
-    cal.gyro_bias[1]  = gyro_bias[1] / meas_count;
-    cal.gyro_bias[2]  = gyro_bias[2] / meas_count;
+    cal.accel_bias[0] = (float)accel_bias[0] / meas_count;
+    cal.accel_bias[1] = (float)accel_bias[1] / meas_count;
+    cal.accel_bias[2] = (float)accel_bias[2] / meas_count;
+    cal.gyro_bias[0]  = (float)gyro_bias[0] / meas_count;
+    cal.gyro_bias[1]  = (float)gyro_bias[1] / meas_count;
+    cal.gyro_bias[2]  = (float)gyro_bias[2] / meas_count;
 
     // Remove gravity from the z-axis accelerometer bias calculation
     const float  accelsensitivity = 16384.;  // = 16384 LSB/g
@@ -367,4 +1058,148 @@ void mpu9150_measure_biases()
         cal.accel_bias[2] -= accelsensitivity;
     else
         cal.accel_bias[2] += accelsensitivity;
+
+    // The biases also seed the temperature model, at the measure temperature. The bins learnt
+    // before are dropped: they may be older than a change that moved the whole bias curve, and
+    // low-passing the new bias into one of them would keep most of the old value.
+    // This is no learnt bin to store by itself: the caller decides whether to keep the measure.
+    cal.gyro_temp_valid = 0;
+    gyro_temp_store(temp / meas_count, cal.gyro_bias);
+    temp_bin_learnt = false;
+
+    mpu9150_apply_calibration();
+
+    // Back to the configured ranges
+    Ascale = a;
+    Gscale = g;
+    mpu9150_write_config();
+}
+
+// Factory trims of the self test responses, in LSB at the self test ranges (gyro
+// 250 deg/s; accel 8 g on the MPU9150, 2 g on the MPU9250), all positive. A zero code means
+// no trim.
+static void mpu9150_factory_trims(float *ft)
+{
+    uint8_t st[4];
+    uint8_t code;
+
+    // SELF_TEST_X, Y, Z: XA_TEST[4:2] in bits 7:5, XG_TEST in bits 4:0. SELF_TEST_A:
+    // XA_TEST[1:0] in bits 5:4, YA_TEST[1:0] in bits 3:2, ZA_TEST[1:0] in bits 1:0.
+    i2c_read_bytes(MPU9150_ADDRESS, SELF_TEST_X, 4, st);
+    for (int i = 0; i < 3; i++) {
+        code = ((st[i] >> 3) & 0x1C) | ((st[3] >> (4 - 2 * i)) & 0x03);
+        ft[i] = code ? 4096.0f * 0.34f * powf(0.92f / 0.34f, (code - 1) / 30.0f) : 0.0f;
+        code = st[i] & 0x1F;
+        ft[i + 3] = code ? 25.0f * 131.0f * powf(1.046f, code - 1) : 0.0f;
+    }
+}
+
+static void mpu9250_factory_trims(float *ft)
+{
+    uint8_t st[3];
+
+    i2c_read_bytes(MPU9150_ADDRESS, SELF_TEST_X_ACCEL_MPU9250, 3, st);
+    for (int i = 0; i < 3; i++)
+        ft[i] = st[i] ? 2620.0f * powf(1.01f, st[i] - 1) : 0.0f;
+    i2c_read_bytes(MPU9150_ADDRESS, SELF_TEST_X_GYRO_MPU9250, 3, st);
+    for (int i = 0; i < 3; i++)
+        ft[i + 3] = st[i] ? 2620.0f * powf(1.01f, st[i] - 1) : 0.0f;
+}
+
+// Average of n raw samples at 1 kHz: accel x, y, z, then gyro x, y, z
+static void mpu9150_average(int32_t *avg, int n)
+{
+    int16_t data[RAW_SAMPLE];
+
+    for (int j = 0; j < 6; j++)
+        avg[j] = 0;
+    for (int i = 0; i < n; i++) {
+        nrf_delay_ms(1);
+        mpu9150_read_raw_data(data, NULL, 0);
+        for (int j = 0; j < 3; j++) {
+            avg[j] += data[j];
+            avg[j + 3] += data[RAW_GYRO + j];
+        }
+    }
+    for (int j = 0; j < 6; j++)
+        avg[j] /= n;
 }
+
+// Self test: the response to the self test actuation (output with it minus output without)
+// must be close enough to the factory trim. The device must not move during the test.
+// Limits: within 14 % of the trim on the MPU9150, 50 % to 150 % of it on the MPU9250.
+bool mpu9150_self_test(void)
+{
+    int32_t normal[6], test[6];
+    float ft[6], ratio;
+    bool pass = true;
+    bool mpu9250 = part == &mpu9250_part;
+    uint8_t accel_fs = mpu9250 ? AFS_2G : AFS_8G;
+
+    // 1 kHz samples, 188 Hz bandwidth, gyro at 250 deg/s
+    i2c_write_byte(MPU9150_ADDRESS, CONFIG, 1);
+    i2c_write_byte(MPU9150_ADDRESS, SMPLRT_DIV, 0);
+    if (part->accel_dlpf)
+        i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG2, 1);
+    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, GFS_250DPS << 3);
+    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, accel_fs << 3);
+    nrf_delay_ms(50);
+    mpu9150_average(normal, 200);
+
+    // Same with the self test bits set on every axis
+    i2c_write_byte(MPU9150_ADDRESS, GYRO_CONFIG, 0xE0 | GFS_250DPS << 3);
+    i2c_write_byte(MPU9150_ADDRESS, ACCEL_CONFIG, 0xE0 | accel_fs << 3);
+    nrf_delay_ms(50);
+    mpu9150_average(test, 200);
+
+    if (mpu9250)
+        mpu9250_factory_trims(ft);
+    else
+        mpu9150_factory_trims(ft);
+
+    for (int i = 0; i < 6; i++) {
+        int32_t str = test[i] - normal[i];
+        ratio = ft[i] != 0.0f ? (str < 0 ? -str : str) / ft[i] : 0.0f;
+        if (mpu9250 ? (ratio < 0.5f || ratio > 1.5f) : (ratio < 0.86f || ratio > 1.14f))
+            pass = false;
+        printf("%s self test : %s %c %ld / %f\r\n", part->name, i < 3 ? "accel" : "gyro",
+               'x' + i % 3, (long)str, ft[i]);
+    }
+    printf("%s self test %s\r\n", part->name, pass ? "passed" : "FAILED");
+
+    // Back to the configured ranges and rate, without the self test bits
+    mpu9150_write_config();
+    nrf_delay_ms(50);
+#ifdef MPU9150_FIFO
+    mpu9150_fifo_reset();
+#endif
+    return pass;
+}
+
+static void mpu_start(void)
+{
+    mpu9150_reset();
+    mpu9150_init();
+}
+
+#define MPU_OPS(part_name, probe_fn) {              \
+    .name               = part_name,                \
+    .probe              = probe_fn,                 \
+    .init               = mpu_start,                \
+    .new_data           = mpu9150_new_data,         \
+    .read_block         = mpu9150_read_data,        \
+    .read_block_ext     = mpu9150_read_data_ext,    \
+    .read_ext           = mpu9150_read_ext,         \
+    .fifo_pending       = mpu9150_fifo_pending,     \
+    .read_fifo          = mpu9150_read_fifo,        \
+    .set_rate           = mpu9150_set_config,       \
+    .sample_period      = mpu9150_sample_period,    \
+    .samples_read       = mpu9150_samples_read,     \
+    .measure_biases     = mpu9150_measure_biases,   \
+    .apply_calibration  = mpu9150_apply_calibration,\
+    .calibration_learnt = mpu9150_gyro_temp_learnt, \
+    .self_test          = mpu9150_self_test,        \
+}
+
+const imu_motion_ops_t mpu9150_ops = MPU_OPS("MPU9150", mpu9150_probe);
+const imu_motion_ops_t mpu9250_ops = MPU_OPS("MPU9250", mpu9250_probe);
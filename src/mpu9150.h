@@ -3,11 +3,46 @@
 
 #include <stdint.h>
 #include <stdbool.h>
+#include "imu_sensor.h"
 
+// InvenSense MPU driver: the MPU9150, and the MPU9250 which shares its register map. The
+// probe selects the part.
+
+// Driver operations, for the imu.c sensor sets
+extern const imu_motion_ops_t mpu9150_ops;
+extern const imu_motion_ops_t mpu9250_ops;
+
+bool mpu9150_probe(void);
+bool mpu9250_probe(void);
 void mpu9150_reset(void);
 void mpu9150_init(void);
 void mpu9150_read_data(float * values);
 void mpu9150_measure_biases(void);
 bool mpu9150_new_data();
+uint32_t mpu9150_sample_period(void);
+// Samples since the previous read (MPU9150_PPI_SAMPLING build), 0 if unknown
+uint8_t mpu9150_samples_read(void);
+bool mpu9150_self_test(void);
+bool mpu9150_set_config(uint8_t accel_g, uint16_t gyro_dps, uint8_t dlpf, uint16_t rate_hz);
+// Derive the fixed-point biases, after any change of the calibration data
+void mpu9150_apply_calibration(void);
+void mpu9150_convert_accel(const int16_t *data, float *values);
+// True once after a new gyro bias temperature bin was learnt (calibration data to be stored)
+bool mpu9150_gyro_temp_learnt(void);
+
+// External sensor data, copied from the auxiliary I2C slaves (EXT_SENS_DATA_00 and up)
+void mpu9150_read_data_ext(float * values, uint8_t *ext, uint8_t ext_len);
+void mpu9150_read_ext(uint8_t *ext, uint8_t ext_len);
+
+// Auxiliary I2C master setup
+void mpu9150_aux_read_setup(uint8_t slave, uint8_t addr, uint8_t reg, uint8_t len);
+void mpu9150_aux_write_setup(uint8_t slave, uint8_t addr, uint8_t reg, uint8_t value);
+void mpu9150_aux_rate(uint8_t mask, uint8_t div);
+void mpu9150_aux_master_enable(bool enable);
+
+// FIFO mode (MPU9150_FIFO build): samples signalled since the last count read, and the reads
+int mpu9150_read_fifo(float *values, int min, int max);
+uint8_t mpu9150_fifo_pending(void);
+uint32_t mpu9150_fifo_overflows(void);
 
 #endif
@@ -0,0 +1,67 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "mpu9150_dmp.h"
+#include "inv_mpu.h"
+#include "inv_mpu_dmp_motion_driver.h"
+#include "app_error.h"
+#include "imu.h"
+#include "mpu9150.h"
+
+// FIFO rate, the same as the other modes
+#define DMP_RATE_HZ 200
+
+void mpu9150_dmp_init(void)
+{
+    long gyro_bias[3];
+
+    // Resets the chip, the data ready GPIOTE set by mpu9150_init() stays
+    APP_ERROR_CHECK_BOOL(mpu_init(NULL) == 0);
+    // Active high 50 us pulses, as expected by the data ready handler
+    mpu_set_int_level(0);
+
+    // The DMP works at 2000 deg/s, the accel stays at 2 g (16384 LSB/g as in the other modes)
+    mpu_set_sensors(INV_XYZ_GYRO | INV_XYZ_ACCEL);
+    mpu_configure_fifo(INV_XYZ_GYRO | INV_XYZ_ACCEL);
+    mpu_set_accel_fsr(2);
+
+    // The measured gyro biases are LSB at 250 deg/s, the offset registers want them at 1000 deg/s.
+    // The DMP refines them when the device stands still (DMP_FEATURE_GYRO_CAL).
+    for (int i = 0; i < 3; i++)
+        gyro_bias[i] = (long)(cal.gyro_bias[i] / 4);
+    mpu_set_gyro_bias_reg(gyro_bias);
+
+    APP_ERROR_CHECK_BOOL(dmp_load_motion_driver_firmware() == 0);
+    dmp_enable_feature(DMP_FEATURE_6X_LP_QUAT | DMP_FEATURE_SEND_RAW_ACCEL | DMP_FEATURE_GYRO_CAL);
+    dmp_set_fifo_rate(DMP_RATE_HZ);
+    dmp_set_interrupt_mode(DMP_INT_CONTINUOUS);
+    mpu_set_dmp_state(1);
+
+    // The compass stays on the nRF side (ak8975a.c)
+    mpu_set_bypass(1);
+}
+
+int mpu9150_dmp_read(float *q, float *accel)
+{
+    short gyro[3], raw[3], sensors;
+    long quat[4];
+    unsigned long timestamp;
+    unsigned char more;
+
+    if (dmp_read_fifo(gyro, raw, quat, &timestamp, &sensors, &more))
+        return -1;
+
+    // XXX FIXME : as in mpu9150_convert(), the accel signs are reversed. The fusion frame
+    // is thus the DMP one turned upside down (half a turn about x in the earth frame):
+    // q = (0, 1, 0, 0) * q_dmp. The quaternion is Q30.
+    const float scale = 1.0f / (1L << 30);
+    q[0] = -quat[1] * scale;
+    q[1] =  quat[0] * scale;
+    q[2] = -quat[3] * scale;
+    q[3] =  quat[2] * scale;
+
+    mpu9150_convert_accel(raw, accel);
+
+    return more;
+}
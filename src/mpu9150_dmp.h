@@ -0,0 +1,15 @@
+#ifndef MPU9150_DMP_H
+#define MPU9150_DMP_H
+
+#include <stdint.h>
+
+// DMP mode (MPU9150_DMP build): the MPU9150 Digital Motion Processor fuses accel and gyro
+// (Invensense motion driver 6.1), the nRF only reads its 6 DOF quaternions and the accel.
+// MUST be called AFTER mpu9150_init(), it resets and configures the chip again.
+void mpu9150_dmp_init(void);
+// Read one FIFO packet: the quaternion (w, x, y, z, in the fusion frame) and the accel (LSB,
+// corrected as by mpu9150_read_data()). Returns the number of packets still in the FIFO, or
+// -1 if there was nothing to read (or an error, the FIFO is then reset).
+int mpu9150_dmp_read(float *q, float *accel);
+
+#endif
@@ -23,9 +23,15 @@ void advertising_init(void) {
   // Use manufacturer specific data to broadcast imu data
   ble_advdata_manuf_data_t adv_manuf_data;
   uint8_array_t            adv_manuf_data_array;
+#ifdef ADV_QUATERNION
+  uint8_t                  adv_manuf_data_data[sizeof(imu_quat_data_t)];
+
+  adv_manuf_data_array.p_data = (uint8_t*) get_imu_quat_data( (imu_quat_data_t*) adv_manuf_data_data );
+#else
   uint8_t                  adv_manuf_data_data[sizeof(imu_data_t)];
 
   adv_manuf_data_array.p_data = (uint8_t*) get_imu_data( (imu_data_t*) adv_manuf_data_data );
+#endif
   adv_manuf_data_array.size = sizeof(adv_manuf_data_data);
 
   // Company identifier of Nordic
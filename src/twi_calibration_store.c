@@ -11,6 +11,8 @@
 
 #define MAGIC1 0xB28AD7CE
 #define MAGIC2 0x3827BEDA
+#define MAGIC3 0x5E1C0A73
+#define MAGIC4 0x93D2F461
 #define ROUND_UP(N, S) ((((N) + (S) - 1) / (S)) * (S))
 #define DATA_SIZE ROUND_UP((MAX(sizeof cal, PSTORAGE_MIN_BLOCK_SIZE)), 4)
 
@@ -64,6 +66,19 @@ bool calibration_store_load(calibration_data_t *data)
         return false;
     }
 
+    // Data stored before the gyro temperature model: keep the rest, learn the model again
+    if (data->magic3 != MAGIC3) {
+        printf("Flash calibration data read : no gyro temperature model.\r\n");
+        memset(data->gyro_temp_bias, 0, sizeof data->gyro_temp_bias);
+        data->gyro_temp_valid = 0;
+    }
+
+    // Data stored before the mag field norm: it is measured again with the next calibration
+    if (data->magic4 != MAGIC4) {
+        printf("Flash calibration data read : no mag field norm.\r\n");
+        data->mag_norm = 0.0f;
+    }
+
     return true;
 }
 
@@ -78,6 +93,8 @@ void calibration_store_write(const calibration_data_t *cal_data) {
     // Ensure magic is correct
     data.magic1 = MAGIC1;
     data.magic2 = MAGIC2;
+    data.magic3 = MAGIC3;
+    data.magic4 = MAGIC4;
 
     // Erase flash block
     pstorage_clear(&flash_handle, DATA_SIZE);
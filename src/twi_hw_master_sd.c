@@ -19,153 +19,10 @@
 #include "nrf_gpio.h"
 #include "nrf_soc.h"
 
-/* Max cycles approximately to wait on RXDREADY and TXDREADY event,
- * This is optimized way instead of using timers, this is not power aware. */
-#define MAX_TIMEOUT_LOOPS             (20000UL)        /**< MAX while loops to wait for RXD/TXD event */
-
-static bool twi_master_write(uint8_t *data, uint8_t data_length, bool issue_stop_condition)
-{
-    uint32_t timeout = MAX_TIMEOUT_LOOPS;   /* max loops to wait for EVENTS_TXDSENT event*/
-
-    if (data_length == 0)
-    {
-        /* Return false for requesting data of size 0 */
-        return false;
-    }
-
-    NRF_TWI1->TXD           = *data++;
-    NRF_TWI1->TASKS_STARTTX = 1;
-
-    /** @snippet [TWI HW master write] */
-    while (true)
-    {
-        while(NRF_TWI1->EVENTS_TXDSENT == 0 && NRF_TWI1->EVENTS_ERROR == 0 && (--timeout))
-        {
-            // Do nothing.
-        }
-
-        if (timeout == 0 || NRF_TWI1->EVENTS_ERROR != 0)
-        {
-          // Recover the peripheral as indicated by PAN 56: "TWI: TWI module lock-up." found at
-          // Product Anomaly Notification document found at
-          // https://www.nordicsemi.com/eng/Products/Bluetooth-R-low-energy/nRF51822/#Downloads
-          NRF_TWI1->EVENTS_ERROR = 0;
-          NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Disabled << TWI_ENABLE_ENABLE_Pos;
-          NRF_TWI1->POWER        = 0;
-          nrf_delay_us(5);
-          NRF_TWI1->POWER        = 1;
-          NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Enabled << TWI_ENABLE_ENABLE_Pos;
-
-          (void)twi_master_init();
-
-          return false;
-        }
-        NRF_TWI1->EVENTS_TXDSENT = 0;
-        if (--data_length == 0)
-        {
-            break;
-        }
-
-        NRF_TWI1->TXD = *data++;
-    }
-    /** @snippet [TWI HW master write] */
-
-    if (issue_stop_condition)
-    {
-        NRF_TWI1->EVENTS_STOPPED = 0;
-        NRF_TWI1->TASKS_STOP     = 1;
-        /* Wait until stop sequence is sent */
-        while(NRF_TWI1->EVENTS_STOPPED == 0)
-        {
-            // Do nothing.
-        }
-    }
-    return true;
-}
-
-
-/** @brief Function for read by twi_master.
- */
-static bool twi_master_read(uint8_t *data, uint8_t data_length, bool issue_stop_condition)
-{
-    uint32_t timeout = MAX_TIMEOUT_LOOPS;   /* max loops to wait for RXDREADY event*/
-
-    if (data_length == 0)
-    {
-        /* Return false for requesting data of size 0 */
-        return false;
-    }
-    else if (data_length == 1)
-    {
-        sd_ppi_channel_assign( 0, &NRF_TWI1->EVENTS_BB, &NRF_TWI1->TASKS_STOP );
-    }
-    else
-    {
-        sd_ppi_channel_assign( 0, &NRF_TWI1->EVENTS_BB, &NRF_TWI1->TASKS_SUSPEND );
-    }
-
-    sd_ppi_channel_enable_set( PPI_CHENSET_CH0_Msk );
-    NRF_TWI1->EVENTS_RXDREADY = 0;
-    NRF_TWI1->TASKS_STARTRX   = 1;
-
-    /** @snippet [TWI HW master read] */
-    while (true)
-    {
-        while(NRF_TWI1->EVENTS_RXDREADY == 0 && NRF_TWI1->EVENTS_ERROR == 0 && (--timeout))
-        {
-            // Do nothing.
-        }
-        NRF_TWI1->EVENTS_RXDREADY = 0;
-
-        if (timeout == 0 || NRF_TWI1->EVENTS_ERROR != 0)
-        {
-          // Recover the peripheral as indicated by PAN 56: "TWI: TWI module lock-up." found at
-          // Product Anomaly Notification document found at
-          // https://www.nordicsemi.com/eng/Products/Bluetooth-R-low-energy/nRF51822/#Downloads
-          NRF_TWI1->EVENTS_ERROR = 0;
-          NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Disabled << TWI_ENABLE_ENABLE_Pos;
-          NRF_TWI1->POWER        = 0;
-          nrf_delay_us(5);
-          NRF_TWI1->POWER        = 1;
-          NRF_TWI1->ENABLE       = TWI_ENABLE_ENABLE_Enabled << TWI_ENABLE_ENABLE_Pos;
-
-          (void)twi_master_init();
-
-          return false;
-        }
-
-        *data++ = NRF_TWI1->RXD;
-
-        /* Configure PPI to stop TWI master before we get last BB event */
-        if (--data_length == 1)
-        {
-            sd_ppi_channel_assign( 0, &NRF_TWI1->EVENTS_BB, &NRF_TWI1->TASKS_STOP );
-        }
-
-        if (data_length == 0)
-        {
-            break;
-        }
-
-        // Recover the peripheral as indicated by PAN 56: "TWI: TWI module lock-up." found at
-        // Product Anomaly Notification document found at
-        // https://www.nordicsemi.com/eng/Products/Bluetooth-R-low-energy/nRF51822/#Downloads
-        nrf_delay_us(20);
-        NRF_TWI1->TASKS_RESUME = 1;
-    }
-    /** @snippet [TWI HW master read] */
-
-    /* Wait until stop sequence is sent */
-    while(NRF_TWI1->EVENTS_STOPPED == 0)
-    {
-        // Do nothing.
-    }
-    NRF_TWI1->EVENTS_STOPPED = 0;
-
-    sd_ppi_channel_enable_clr ( PPI_CHENCLR_CH0_Msk );
-    return true;
-}
+/* Bus set up and recovery only: the transfers are run by i2c_async.c. */
 
+/* Bus clear attempts, for the bus diagnostics */
+uint32_t twi_master_clear_bus_count = 0;
 
 /**
  * @brief Function for detecting stuck slaves (SDA = 0 and SCL = 1) and tries to clear the bus.
@@ -181,6 +38,8 @@ static bool twi_master_clear_bus(void)
     uint32_t clk_pin_config;
     uint32_t data_pin_config;
 
+    twi_master_clear_bus_count++;
+
     // Save and disable TWI hardware so software can take control over the pins.
     twi_state        = NRF_TWI1->ENABLE;
     NRF_TWI1->ENABLE = TWI_ENABLE_ENABLE_Disabled << TWI_ENABLE_ENABLE_Pos;
@@ -278,29 +137,4 @@ bool twi_master_init(void)
     return twi_master_clear_bus();
 }
 
-
-/** @brief  Function for transfer by twi_master.
- */
-bool twi_master_transfer(uint8_t   address,
-                         uint8_t * data,
-                         uint8_t   data_length,
-                         bool      issue_stop_condition)
-{
-    bool transfer_succeeded = false;
-    if (data_length > 0 && twi_master_clear_bus())
-    {
-        NRF_TWI1->ADDRESS = (address >> 1);
-
-        if ((address & TWI_READ_BIT))
-        {
-            transfer_succeeded = twi_master_read(data, data_length, issue_stop_condition);
-        }
-        else
-        {
-            transfer_succeeded = twi_master_write(data, data_length, issue_stop_condition);
-        }
-    }
-    return transfer_succeeded;
-}
-
 /*lint --flb "Leave library region" */
@@ -61,7 +61,9 @@ bool getchar_timeout(uint32_t timeout_ms, char *c)
 void uart_init()
 {
     simple_uart_config(UART_RTS_PIN, UART_TX_PIN, UART_CTS_PIN, UART_RX_PIN, false);
+#ifndef FAST_BOOT
     nrf_delay_ms(300);
+#endif
 }
 
 int putchar(int c)